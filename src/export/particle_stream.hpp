@@ -0,0 +1,79 @@
+#pragma once
+
+// Layout of the shared memory segment in which the solver publishes the particles
+//
+// This header is shared by the exporter (SharedMemoryExporter) and the readers (ParticleStreamReader) and must not
+// depend on CGP. The segment starts with a particle_stream_header followed by slot_count slots, each made of a
+// particle_stream_slot header and the arrays x, y, vx, vy, rho of capacity floats (structure of arrays, so that a
+// reader only touches the fields it needs).
+//
+// Every slot is protected by a sequence lock: the writer makes the sequence odd, writes the slot, then sets it to
+// 2 * frame. A reader checks the sequence before and after reading the slot in place; the frame was read consistently
+// if both values are equal and even. The writer never waits for the readers, and it only comes back to a slot after
+// slot_count - 1 other frames, which leaves the readers that long to use a frame.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__EMSCRIPTEN__)
+#define SPH_HAS_SHARED_MEMORY
+#endif
+
+// Default name of the segment, under /dev/shm on Linux
+#define PARTICLE_STREAM_DEFAULT_NAME "/sph_particles"
+
+uint32_t const particle_stream_magic = 0x53504831; // "SPH1"
+uint32_t const particle_stream_version = 1;
+
+// Fields of a slot, in the order of their arrays
+enum particle_stream_field {
+    FIELD_X,
+    FIELD_Y,
+    FIELD_VX,
+    FIELD_VY,
+    FIELD_RHO,
+    NUMBER_OF_PARTICLE_STREAM_FIELDS
+};
+
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "Sequence numbers must be plain 64 bits words");
+
+struct particle_stream_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;   // Number of frames kept in the ring
+    uint32_t capacity;     // Maximum number of particles of a frame
+    uint64_t slot_stride;  // Size in bytes of a slot, header included
+    uint64_t segment_size; // Size in bytes of the whole segment
+
+    std::atomic<uint64_t> latest_frame; // Last completed frame, 0 before the first one
+    std::atomic<uint32_t> closed;       // Set when the writer abandons the segment (readers should reopen it)
+};
+
+struct alignas(64) particle_stream_slot {
+    std::atomic<uint64_t> sequence; // Odd while the slot is written, 2 * frame once it is complete
+    uint64_t step;                  // Number of solver steps since the start of the simulation
+    double time;                    // Simulated time of the frame
+    uint32_t number_of_particles;
+};
+
+// Size of a slot able to hold capacity particles, rounded up to keep the slots aligned on cache lines
+inline uint64_t particle_stream_slot_stride(uint32_t capacity) {
+    uint64_t const size = sizeof(particle_stream_slot) + NUMBER_OF_PARTICLE_STREAM_FIELDS * sizeof(float) * uint64_t(capacity);
+    return (size + 63) / 64 * 64;
+}
+
+inline uint64_t particle_stream_segment_size(uint32_t slot_count, uint32_t capacity) {
+    uint64_t const header_size = (sizeof(particle_stream_header) + 63) / 64 * 64;
+    return header_size + uint64_t(slot_count) * particle_stream_slot_stride(capacity);
+}
+
+inline particle_stream_slot* particle_stream_get_slot(particle_stream_header* header, uint64_t frame) {
+    uint64_t const header_size = (sizeof(particle_stream_header) + 63) / 64 * 64;
+    char* const base = reinterpret_cast<char*>(header) + header_size;
+    return reinterpret_cast<particle_stream_slot*>(base + (frame % header->slot_count) * header->slot_stride);
+}
+
+inline float* particle_stream_get_field(particle_stream_slot* slot, uint32_t capacity, particle_stream_field field) {
+    return reinterpret_cast<float*>(slot + 1) + size_t(field) * capacity;
+}
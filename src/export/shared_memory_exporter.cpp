@@ -0,0 +1,139 @@
+#include "shared_memory_exporter.hpp"
+#include "grid2D.hpp"
+#include "profiling/profiler.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <new>
+
+#ifdef SPH_HAS_SHARED_MEMORY
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+SharedMemoryExporter::~SharedMemoryExporter() {
+    close();
+}
+
+bool SharedMemoryExporter::open(std::string const& segment_name, unsigned int capacity, unsigned int slot_count) {
+    close();
+
+#ifdef SPH_HAS_SHARED_MEMORY
+    slot_count = std::max(2u, slot_count);
+    capacity = std::max(1u, capacity);
+    uint64_t const segment_size = particle_stream_segment_size(slot_count, capacity);
+
+    // Readers still attached to a previous segment of the same name keep their mapping, the name points to the new one
+    shm_unlink(segment_name.c_str());
+    int const fd = shm_open(segment_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        std::cerr << "Shared memory: cannot create " << segment_name << std::endl;
+        return false;
+    }
+
+    void* memory = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(segment_size)) == 0) {
+        memory = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+
+    if (memory == MAP_FAILED) {
+        std::cerr << "Shared memory: cannot map " << segment_size << " bytes for " << segment_name << std::endl;
+        shm_unlink(segment_name.c_str());
+        return false;
+    }
+
+    // The pages are zeroed by ftruncate: every slot starts with the sequence 0, i.e. no frame
+    header = new (memory) particle_stream_header;
+    header->slot_count = slot_count;
+    header->capacity = capacity;
+    header->slot_stride = particle_stream_slot_stride(capacity);
+    header->segment_size = segment_size;
+    header->latest_frame.store(0, std::memory_order_relaxed);
+    header->closed.store(0, std::memory_order_relaxed);
+    for (unsigned int k = 0; k < slot_count; ++k) {
+        new (particle_stream_get_slot(header, k)) particle_stream_slot;
+    }
+
+    // Written last, a reader only trusts the segment once the magic number is there
+    header->version = particle_stream_version;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = particle_stream_magic;
+
+    name = segment_name;
+    frame = 0;
+    return true;
+#else
+    (void) capacity;
+    (void) slot_count;
+    std::cerr << "Shared memory: not supported on this system, cannot create " << segment_name << std::endl;
+    return false;
+#endif
+}
+
+void SharedMemoryExporter::close() {
+#ifdef SPH_HAS_SHARED_MEMORY
+    if (header == nullptr) {
+        return;
+    }
+
+    header->closed.store(1, std::memory_order_release);
+    munmap(header, header->segment_size);
+    shm_unlink(name.c_str());
+    header = nullptr;
+#endif
+}
+
+bool SharedMemoryExporter::publish(Grid2d const& grid, double time, unsigned long step) {
+    if (header == nullptr) {
+        return false;
+    }
+
+    PROFILE_SCOPE("shared memory export");
+
+    auto const& particles = grid.get_all_particles();
+    if (particles.size() > header->capacity) {
+        // Grow with some margin, the readers see the old segment closed and reopen the new one
+        std::string const segment_name = name;
+        unsigned long const published_frames = frame;
+        unsigned int const slot_count = header->slot_count;
+        if (!open(segment_name, static_cast<unsigned int>(2 * particles.size()), slot_count)) {
+            return false;
+        }
+        frame = published_frames;
+    }
+
+    frame++;
+    particle_stream_slot* slot = particle_stream_get_slot(header, frame);
+    uint32_t const capacity = header->capacity;
+
+    // Sequence lock: odd while writing, the release fence keeps the data writes after it
+    slot->sequence.store(2 * frame - 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    float* x = particle_stream_get_field(slot, capacity, FIELD_X);
+    float* y = particle_stream_get_field(slot, capacity, FIELD_Y);
+    float* vx = particle_stream_get_field(slot, capacity, FIELD_VX);
+    float* vy = particle_stream_get_field(slot, capacity, FIELD_VY);
+    float* rho = particle_stream_get_field(slot, capacity, FIELD_RHO);
+
+    int const N = static_cast<int>(particles.size());
+    for (int i = 0; i < N; ++i) {
+        particle_element const* particle = particles[i];
+        x[i] = particle->p.x;
+        y[i] = particle->p.y;
+        vx[i] = particle->v.x;
+        vy[i] = particle->v.y;
+        rho[i] = particle->rho;
+    }
+
+    slot->step = step;
+    slot->time = time;
+    slot->number_of_particles = static_cast<uint32_t>(N);
+
+    slot->sequence.store(2 * frame, std::memory_order_release);
+    header->latest_frame.store(frame, std::memory_order_release);
+
+    return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "export/particle_stream.hpp"
+
+#include <string>
+
+class Grid2d;
+
+/**
+ * @brief Publishes the particles of every completed frame in a POSIX shared memory ring buffer
+ *
+ * Other processes attach to the segment with ParticleStreamReader (tools/particle_stream) and read the latest frame in
+ * place. Publishing never waits for the readers: a reader that is too slow sees its frame overwritten and simply moves
+ * on to the next one. The layout of the segment is described in export/particle_stream.hpp
+ *
+ * Shared memory is only available on Unix systems, elsewhere open always fails
+ */
+class SharedMemoryExporter {
+public:
+    SharedMemoryExporter() = default;
+    ~SharedMemoryExporter();
+
+    SharedMemoryExporter(SharedMemoryExporter const&) = delete;
+    SharedMemoryExporter& operator=(SharedMemoryExporter const&) = delete;
+
+    /**
+     * @brief Create (or replace) the segment
+     *
+     * @param name The name of the segment, starting with '/'
+     * @param capacity The maximum number of particles of a frame, the segment is recreated larger if it is exceeded
+     * @param slot_count The number of frames kept in the ring (at least 2)
+     * @return false if the segment could not be created
+     */
+    bool open(std::string const& name, unsigned int capacity, unsigned int slot_count = 4);
+
+    /**
+     * @brief Mark the segment as closed for the readers and remove it
+     */
+    void close();
+
+    bool is_open() const { return header != nullptr; }
+
+    std::string const& get_name() const { return name; }
+
+    unsigned long get_published_frames() const { return frame; }
+
+    /**
+     * @brief Copy the positions, velocities and densities of the particles in the next slot of the ring
+     *
+     * @param grid The particles to publish
+     * @param time The simulated time of the frame
+     * @param step The number of solver steps since the start of the simulation
+     * @return false if the segment is not open or could not be grown
+     */
+    bool publish(Grid2d const& grid, double time, unsigned long step);
+
+private:
+    std::string name;
+    particle_stream_header* header = nullptr;
+    unsigned long frame = 0; // Number of published frames
+};
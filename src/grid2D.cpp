@@ -1,12 +1,17 @@
 #include "grid2D.hpp"
+#include "profiling/profiler.hpp"
 
+#include <chrono>
 #include <iostream>
+#include <limits>
 
 using namespace cgp;
 
-Grid2d::Grid2d(const sph_parameters_structure &sph_parameters) {
-    // Example: Initialize grid_size and cell_size based on sph_parameters
-    cell_size = sph_parameters.h;
+Grid2d::Grid2d(const sph_parameters_structure &sph_parameters) : subdivision(1), skip_far_cells(false), periodic_x(false), periodic_y(false),
+                                                                 compact_storage(false), compact_velocity_storage(false) {
+    // Initialize grid_size and cell_size based on sph_parameters
+    influence_radius = sph_parameters.h;
+    cell_size = influence_radius / static_cast<float>(subdivision);
 
     // Calculate grid_size based on cell_size and domain size
     grid_size = static_cast<int>(2 / cell_size);
@@ -17,7 +22,49 @@ Grid2d::Grid2d(const sph_parameters_structure &sph_parameters) {
     }
 }
 
-std::pair<int, int> Grid2d::get_cell_coordinates(particle_element p) {
+Grid2d& Grid2d::operator=(Grid2d&& other) noexcept {
+    // The previous state of this grid ends up in moved, which frees its particles when going out of scope
+    Grid2d moved(std::move(other));
+    swap(moved);
+    return *this;
+}
+
+Grid2d::~Grid2d() {
+    for (auto particle : particles) {
+        delete particle;
+    }
+}
+
+void Grid2d::swap(Grid2d &other) noexcept {
+    using std::swap;
+
+    swap(influence_radius, other.influence_radius);
+    swap(subdivision, other.subdivision);
+    swap(skip_far_cells, other.skip_far_cells);
+    swap(periodic_x, other.periodic_x);
+    swap(periodic_y, other.periodic_y);
+    swap(compact_storage, other.compact_storage);
+    swap(compact_velocity_storage, other.compact_velocity_storage);
+    swap(cell_size, other.cell_size);
+    swap(grid_size, other.grid_size);
+    swap(generator, other.generator);
+    swap(grid, other.grid);
+    swap(cell_ids, other.cell_ids);
+    swap(particles, other.particles);
+    swap(compact_cell_start, other.compact_cell_start);
+    swap(compact_slots, other.compact_slots);
+    swap(compact_next_slot, other.compact_next_slot);
+    swap(compact_particles, other.compact_particles);
+    swap(compact_positions, other.compact_positions);
+    swap(compact_velocities, other.compact_velocities);
+    swap(compact_float_velocities, other.compact_float_velocities);
+    swap(compact_scales, other.compact_scales);
+    swap(compact_rho, other.compact_rho);
+    swap(compact_pressure, other.compact_pressure);
+    swap(velocity_quantum, other.velocity_quantum);
+}
+
+std::pair<int, int> Grid2d::get_cell_coordinates(particle_element const& p) const {
     // Calculate the normalized coordinates within the grid
     float normalizedX = (p.p.x + 1.0f) * 0.5f;
     float normalizedY = (p.p.y + 1.0f) * 0.5f;
@@ -34,18 +81,25 @@ std::pair<int, int> Grid2d::get_cell_coordinates(particle_element p) {
 }
 
 void Grid2d::clear() {
-    // Clear the grid
-    for (int i = 0; i < grid_size; i++) {
-        for (int j = 0; j < grid_size; j++) {
-            grid[i][j].clear();
+    // Clear the grid (iterating over the cells themselves, a moved-from grid has none)
+    for (auto& column : grid) {
+        for (auto& cell : column) {
+            cell.clear();
         }
     }
 
+    // Free the particles created by create_grid
+    for (auto particle : particles) {
+        delete particle;
+    }
+
     // Clear the particles vector
     particles.clear();
 }
 
 void Grid2d::add_particle(particle_element *p) {
+    wrap_position(p->p);
+
     // Add the particle to the grid
     std::pair<int, int> cell_coordinates = get_cell_coordinates(*p);
 
@@ -55,51 +109,135 @@ void Grid2d::add_particle(particle_element *p) {
     particles.push_back(grid[cell_coordinates.first][cell_coordinates.second].back());
 }
 
+unsigned long Grid2d::get_number_of_sleeping_particles() {
+    unsigned long count = 0;
+    for (auto particle : particles) {
+        if (particle->sleeping) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+void Grid2d::wake_all_particles() {
+    for (auto particle : particles) {
+        particle->wake();
+    }
+}
+
 void Grid2d::update_particles() {
-    // Reset grid
-    grid.clear();
-    grid.resize(grid_size);
-    for (int i = 0; i < grid_size; ++i) {
-        grid[i].resize(grid_size);
+    std::vector<int>& ids = get_cell_ids();
+    for (size_t k = 0; k < particles.size(); ++k) {
+        ids[k] = get_cell_id(particles[k]->p);
+    }
+
+    update_particles_from_cell_ids();
+}
+
+std::vector<int>& Grid2d::get_cell_ids() {
+    cell_ids.resize(particles.size());
+    return cell_ids;
+}
+
+void Grid2d::update_particles_from_cell_ids() {
+    PROFILE_SCOPE("grid rebuild");
+
+    // Reset grid, keeping the memory of the cells when the size did not change
+    if (static_cast<int>(grid.size()) != grid_size) {
+        grid.clear();
+        grid.resize(grid_size);
+        for (int i = 0; i < grid_size; ++i) {
+            grid[i].resize(grid_size);
+        }
+    } else {
+        for (int i = 0; i < grid_size; ++i) {
+            for (int j = 0; j < grid_size; ++j) {
+                grid[i][j].clear();
+            }
+        }
     }
 
-    for (auto& particle : particles) {
-        std::pair<int, int> cell_coordinates = get_cell_coordinates(*particle);
-        grid[cell_coordinates.first][cell_coordinates.second].push_back(particle);
+    for (size_t k = 0; k < particles.size(); ++k) {
+        int const id = cell_ids[k];
+        grid[id / grid_size][id % grid_size].push_back(particles[k]);
     }
 }
 
-std::vector<particle_element*> Grid2d::get_particles_influencing(particle_element particle) {
+std::vector<particle_element*> Grid2d::get_particles_influencing(particle_element const& particle) const {
     std::vector<particle_element*> influencing_particles;
 
-    // Get the cell coordinates of the particle
-    std::pair<int, int> cell_coords = get_cell_coordinates(particle);
-    int cell_x = cell_coords.first;
-    int cell_y = cell_coords.second;
-
-    // Define a range of neighboring cells to check
-    int min_x = std::max(0, cell_x - 1);
-    int max_x = std::min(grid_size - 1, cell_x + 1);
-    int min_y = std::max(0, cell_y - 1);
-    int max_y = std::min(grid_size - 1, cell_y + 1);
-
-    // Iterate over neighboring cells and add particles from those cells
-    for (int x = min_x; x <= max_x; ++x) {
-        for (int y = min_y; y <= max_y; ++y) {
-            std::vector<particle_element *>& cell = grid[x][y];
-            for (auto neighbor_particle : cell) {
-                // TODO FIX
-                if (norm(neighbor_particle->p - particle.p) < cell_size) {
-                    influencing_particles.push_back(neighbor_particle);
+    for_each_particle_in_radius(particle.p, influence_radius, [&](particle_element* neighbour_particle) {
+        influencing_particles.push_back(neighbour_particle);
+    });
+
+    return influencing_particles;
+}
+
+int Grid2d::get_k_nearest(vec3 const& center, int k, particle_element** nearest) const {
+    if (k <= 0) {
+        return 0;
+    }
+
+    vec3 wrapped_center = center;
+    wrap_position(wrapped_center);
+    int const center_cell = get_cell_id(wrapped_center);
+    std::pair<int, int> const cell_coords = std::make_pair(center_cell / grid_size, center_cell % grid_size);
+    float const cell_width = 2.0f / static_cast<float>(grid_size);
+
+    // Along a periodic axis the offsets from the center cell wrap around, keep each cell once: offsets in
+    // [-(grid_size - 1) / 2, grid_size / 2]
+    auto const outside = [&](int offset, bool periodic, int cell) {
+        return periodic ? offset < -(grid_size - 1) / 2 || offset > grid_size / 2 : cell < 0 || cell >= grid_size;
+    };
+
+    int found = 0;
+    for (int ring = 0; ring < grid_size; ++ring) {
+        // Visit the cells at Chebyshev distance ring from the cell of the center
+        for (int x = cell_coords.first - ring; x <= cell_coords.first + ring; ++x) {
+            for (int y = cell_coords.second - ring; y <= cell_coords.second + ring; ++y) {
+                int const dx = x - cell_coords.first;
+                int const dy = y - cell_coords.second;
+                bool const on_ring = std::abs(dx) == ring || std::abs(dy) == ring;
+                if (!on_ring || outside(dx, periodic_x, x) || outside(dy, periodic_y, y)) {
+                    continue;
+                }
+
+                int const cell_x = periodic_x ? wrap_cell(x) : x;
+                int const cell_y = periodic_y ? wrap_cell(y) : y;
+                for (particle_element* particle : grid[cell_x][cell_y]) {
+                    float const distance = norm(minimum_image(particle->p - center));
+
+                    // Insertion in the sorted list of the k best candidates
+                    int position = found < k ? found : k;
+                    while (position > 0 && norm(minimum_image(nearest[position - 1]->p - center)) > distance) {
+                        if (position < k) {
+                            nearest[position] = nearest[position - 1];
+                        }
+                        position--;
+                    }
+                    if (position < k) {
+                        nearest[position] = particle;
+                        found = std::min(found + 1, k);
+                    }
                 }
             }
         }
+
+        // Any particle beyond this ring is at least ring * cell_width away
+        if (found == k && norm(minimum_image(nearest[k - 1]->p - center)) <= ring * cell_width) {
+            break;
+        }
     }
 
-    return influencing_particles;
+    return found;
+}
+
+float Grid2d::random_interval(float min, float max) {
+    return std::uniform_real_distribution<float>(min, max)(generator);
 }
 
-vec3 get_initial_velocity(initial_velocity velocity) {
+vec3 get_initial_velocity(initial_velocity velocity, Grid2d &grid) {
     switch (velocity) {
         case initial_velocity::DOWN:
             return vec3{0, -1, 0};
@@ -112,7 +250,7 @@ vec3 get_initial_velocity(initial_velocity velocity) {
         case initial_velocity::NONE:
             return vec3{0, 0, 0};
         case initial_velocity::RANDOM:
-            return vec3{rand_interval(-1.0f, 1.0f), rand_interval(-1.0f, 1.0f), 0};
+            return vec3{grid.random_interval(-1.0f, 1.0f), grid.random_interval(-1.0f, 1.0f), 0};
         default:
             return vec3{0, 0, 0};
     }
@@ -120,14 +258,23 @@ vec3 get_initial_velocity(initial_velocity velocity) {
 
 void Grid2d::create_grid(const grid_init_param &grid_init_param) {
     clear();
+    generator.seed(grid_init_param.seed);
+
+    float true_spacing = grid_init_param.spacing * influence_radius;
 
-    float true_spacing = grid_init_param.spacing * cell_size;
+    // Along a periodic axis, fill the whole period with a whole number of rows so that the seam is not visible
+    float const spacing_x = periodic_x ? 2.0f / std::floor(2.0f / true_spacing) : true_spacing;
+    float const spacing_y = periodic_y ? 2.0f / std::floor(2.0f / true_spacing) : true_spacing;
+    float const start_x = periodic_x ? -1 + 0.5f * spacing_x : -1 + grid_init_param.padding.x;
+    float const start_y = periodic_y ? -1 + 0.5f * spacing_y : -1 + grid_init_param.padding.y;
+    float const end_x = periodic_x ? 1 : 1 - grid_init_param.padding.x;
+    float const end_y = periodic_y ? 1 : 1 - grid_init_param.padding.y;
 
-    for (float i = -1 + grid_init_param.padding.x; i <= 1 - grid_init_param.padding.x; i += true_spacing) {
-        for (float j = -1 + grid_init_param.padding.y; j <= 1 - grid_init_param.padding.y; j += true_spacing) {
+    for (float i = start_x; i <= end_x; i += spacing_x) {
+        for (float j = start_y; j <= end_y; j += spacing_y) {
             auto *particle = new particle_element();
-            particle->p = vec3{i + cell_size / 8.0 * rand_interval(), j + cell_size / 8.0 * rand_interval(), 0};
-            particle->v = get_initial_velocity(grid_init_param.velocity);
+            particle->p = vec3{i + influence_radius / 8.0 * random_interval(), j + influence_radius / 8.0 * random_interval(), 0};
+            particle->v = get_initial_velocity(grid_init_param.velocity, *this);
 
             add_particle(particle);
         }
@@ -135,10 +282,158 @@ void Grid2d::create_grid(const grid_init_param &grid_init_param) {
 }
 
 void Grid2d::resize(float size) {
-    if (cell_size == size) return;
+    if (influence_radius == size) return;
+
+    influence_radius = size;
+    cell_size = influence_radius / static_cast<float>(subdivision);
+    grid_size = static_cast<int>(2 / cell_size);
+
+    // Densities depend on the kernel size, frozen values are no longer valid
+    wake_all_particles();
+    update_particles();
+}
 
-    cell_size = size;
+void Grid2d::set_stencil(int new_subdivision, bool new_skip_far_cells) {
+    skip_far_cells = new_skip_far_cells;
+    if (subdivision == new_subdivision) return;
+
+    subdivision = new_subdivision;
+    cell_size = influence_radius / static_cast<float>(subdivision);
     grid_size = static_cast<int>(2 / cell_size);
 
     update_particles();
 }
+
+void Grid2d::set_periodic(bool x, bool y) {
+    periodic_x = x;
+    periodic_y = y;
+
+    for (auto particle : particles) {
+        wrap_position(particle->p);
+    }
+
+    // Neighbourhoods change across the edges, frozen densities are no longer valid
+    wake_all_particles();
+    update_particles();
+}
+
+void Grid2d::set_compact_storage(bool enabled, bool quantize_velocity) {
+    compact_storage = enabled;
+    compact_velocity_storage = quantize_velocity;
+
+    if (compact_storage) {
+        update_compact_storage();
+        update_compact_fields();
+    }
+}
+
+void Grid2d::update_compact_storage() {
+    PROFILE_SCOPE("compact encoding");
+
+    int const N = static_cast<int>(particles.size());
+    int const cells = grid_size * grid_size;
+
+    // Counting sort of the particles by cell
+    compact_slots.resize(N);
+    compact_cell_start.assign(cells + 1, 0);
+    for (int k = 0; k < N; ++k) {
+        compact_slots[k] = get_cell_id(particles[k]->p);
+        compact_cell_start[compact_slots[k] + 1]++;
+    }
+    for (int c = 0; c < cells; ++c) {
+        compact_cell_start[c + 1] += compact_cell_start[c];
+    }
+
+    compact_next_slot.assign(compact_cell_start.begin(), compact_cell_start.end() - 1);
+    for (int k = 0; k < N; ++k) {
+        compact_slots[k] = compact_next_slot[compact_slots[k]]++;
+    }
+
+    compact_particles.resize(N);
+    compact_positions.resize(N);
+    compact_scales.resize(N);
+    compact_rho.resize(N);
+    compact_pressure.resize(N);
+
+    // The velocity quantum follows the fastest particle, so that its full range is used
+    float max_velocity = 0.0f;
+    for (auto particle : particles) {
+        max_velocity = std::max(max_velocity, std::max(std::abs(particle->v.x), std::abs(particle->v.y)));
+    }
+    velocity_quantum = max_velocity > 0.0f ? max_velocity / 32767.0f : 1.0f;
+
+    if (compact_velocity_storage) {
+        compact_velocities.resize(N);
+    } else {
+        compact_float_velocities.resize(2 * N);
+    }
+
+    float const width = 2.0f / static_cast<float>(grid_size);
+    float const levels = 65534.0f / width;
+
+    #pragma omp parallel for
+    for (int k = 0; k < N; ++k) {
+        particle_element const* particle = particles[k];
+        int const slot = compact_slots[k];
+        int const cell = get_cell_id(particle->p);
+
+        float const offset_x = std::round((particle->p.x + 1.0f - (cell / grid_size) * width) * levels);
+        float const offset_y = std::round((particle->p.y + 1.0f - (cell % grid_size) * width) * levels);
+        bool const inside = offset_x >= 0 && offset_x <= 65534.0f && offset_y >= 0 && offset_y <= 65534.0f;
+
+        compact_particles[slot] = particles[k];
+        compact_positions[slot].x = inside ? static_cast<uint16_t>(offset_x) : compact_outside;
+        compact_positions[slot].y = inside ? static_cast<uint16_t>(offset_y) : compact_outside;
+        compact_scales[slot] = particle->scale;
+
+        if (compact_velocity_storage) {
+            compact_velocities[slot].x = static_cast<int16_t>(std::round(particle->v.x / velocity_quantum));
+            compact_velocities[slot].y = static_cast<int16_t>(std::round(particle->v.y / velocity_quantum));
+        } else {
+            compact_float_velocities[2 * slot] = particle->v.x;
+            compact_float_velocities[2 * slot + 1] = particle->v.y;
+        }
+    }
+}
+
+void Grid2d::update_compact_fields() {
+    int const N = static_cast<int>(particles.size());
+
+    #pragma omp parallel for
+    for (int k = 0; k < N; ++k) {
+        int const slot = compact_slots[k];
+        compact_rho[slot] = particles[k]->rho;
+        compact_pressure[slot] = particles[k]->pressure;
+    }
+}
+
+std::vector<grid_stencil_benchmark> Grid2d::auto_tune(sph_parameters_structure const& sph_parameters, int repetitions) {
+    std::vector<grid_stencil_benchmark> benchmarks;
+
+    for (int candidate_subdivision = 1; candidate_subdivision <= 3; ++candidate_subdivision) {
+        for (int candidate_skip = 0; candidate_skip <= 1; ++candidate_skip) {
+            set_stencil(candidate_subdivision, candidate_skip == 1);
+
+            // A real density pass, with the same OpenMP threads and skipped particles as the simulation (the particles
+            // do not move, so it recomputes the same densities)
+            double best_time = std::numeric_limits<double>::max();
+            for (int repetition = 0; repetition < repetitions; ++repetition) {
+                auto const start = std::chrono::steady_clock::now();
+                update_density(*this, sph_parameters);
+                auto const end = std::chrono::steady_clock::now();
+
+                best_time = std::min(best_time, std::chrono::duration<double, std::milli>(end - start).count());
+            }
+
+            benchmarks.push_back({candidate_subdivision, candidate_skip == 1, best_time});
+        }
+    }
+
+    auto const best = std::min_element(benchmarks.begin(), benchmarks.end(),
+                                       [](grid_stencil_benchmark const& a, grid_stencil_benchmark const& b) {
+                                           return a.milliseconds < b.milliseconds;
+                                       });
+    set_stencil(best->subdivision, best->skip_far_cells);
+
+    return benchmarks;
+}
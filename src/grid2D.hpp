@@ -3,6 +3,12 @@
 #include "cgp/cgp.hpp"
 #include "simulation/simulation.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+
 enum initial_velocity {
     NONE,
     RANDOM,
@@ -16,13 +22,35 @@ struct grid_init_param {
     float spacing; // spacing is relative to the particle size
     cgp::vec2 padding; // Padding is under the form (top/bottom, left/right)
     initial_velocity velocity;
+    unsigned int seed; // seed of the random generator of the grid (position jitter, random velocities)
 
-    grid_init_param() : spacing(1.2f), padding(cgp::vec2(0.2f, 0.2f)), velocity(NONE) {}
+    grid_init_param() : spacing(1.2f), padding(cgp::vec2(0.2f, 0.2f)), velocity(NONE), seed(std::random_device{}()) {}
 
     grid_init_param(
             float spacing,
             cgp::vec2 padding,
-            initial_velocity velocity) : spacing(spacing), padding(padding), velocity(velocity) {}
+            initial_velocity velocity,
+            unsigned int seed = std::random_device{}()) : spacing(spacing), padding(padding), velocity(velocity), seed(seed) {}
+};
+
+// Timing of one cell size / stencil configuration measured by Grid2d::auto_tune
+struct grid_stencil_benchmark {
+    int subdivision;     // cells of size h / subdivision
+    bool skip_far_cells; // cells farther than h from the query point are skipped
+    double milliseconds; // time of a density pass (update_density)
+};
+
+// Position of a particle relative to the lower corner of its cell, in 1/65534 of the cell width (0xFFFF marks a particle
+// outside of its cell)
+struct compact_position {
+    uint16_t x;
+    uint16_t y;
+};
+
+// Velocity of a particle in units of the velocity quantum of the grid
+struct compact_velocity {
+    int16_t x;
+    int16_t y;
 };
 
 /**
@@ -32,79 +60,507 @@ struct grid_init_param {
  * much better result than a naive search
  *
  * Grid will always be a square between (-1, -1) and (1, 1)
+ *
+ * The cells have a size of h / subdivision: queries of radius h then visit a stencil of (2 subdivision + 1)^2 cells
+ * (3x3, 5x5 or 7x7). Finer cells test fewer particles outside of the interaction circle but add cell overhead, the
+ * best choice depends on the particle distribution and can be measured with auto_tune
+ *
+ * Each axis can be made periodic: the positions are wrapped into [-1, 1), the radius queries wrap their stencil across
+ * the edges and the distances between particles are taken between closest images (minimum image convention). Particles
+ * are never duplicated
  */
 class Grid2d {
 public:
     explicit Grid2d(const sph_parameters_structure& sph_parameters);
 
-    Grid2d(const Grid2d& other) = default;
+    // The grid owns its particles: it can be moved but not copied, and frees them when destroyed
+    Grid2d(const Grid2d& other) = delete;
+    Grid2d& operator=(const Grid2d& other) = delete;
+    Grid2d(Grid2d&& other) noexcept = default;
+    Grid2d& operator=(Grid2d&& other) noexcept;
+    ~Grid2d();
 
     /**
      * @brief A way to resize the grid
      *
-     * @param size The new size of the grid
+     * @param size The new influence radius h of the particles
      */
     void resize(float size);
 
+    /**
+     * @brief Choose the cell size and the stencil used by the queries
+     *
+     * @param subdivision The cells have a size of h / subdivision
+     * @param skip_far_cells Skip the cells of the stencil whose closest point is beyond the query radius
+     */
+    void set_stencil(int subdivision, bool skip_far_cells);
+
+    inline int get_subdivision() const { return subdivision; }
+    inline bool get_skip_far_cells() const { return skip_far_cells; }
+
+    /**
+     * @brief Choose which axes are periodic, the positions of the particles are wrapped accordingly
+     *
+     * @param x Whether the left and right edges are connected
+     * @param y Whether the bottom and top edges are connected
+     */
+    void set_periodic(bool x, bool y);
+
+    inline bool is_periodic_x() const { return periodic_x; }
+    inline bool is_periodic_y() const { return periodic_y; }
+
+    /**
+     * @brief Get the shortest displacement between two images of the points (minimum image convention)
+     *
+     * @param d The displacement between two positions of the domain
+     * @return d, reduced to [-1, 1) along the periodic axes
+     */
+    inline cgp::vec3 minimum_image(cgp::vec3 d) const {
+        if (periodic_x) d.x -= 2.0f * std::floor(0.5f * d.x + 0.5f);
+        if (periodic_y) d.y -= 2.0f * std::floor(0.5f * d.y + 0.5f);
+        return d;
+    }
+
+    /**
+     * @brief Bring a position back into [-1, 1) along the periodic axes
+     */
+    inline void wrap_position(cgp::vec3& p) const {
+        if (periodic_x) p.x -= 2.0f * std::floor(0.5f * (p.x + 1.0f));
+        if (periodic_y) p.y -= 2.0f * std::floor(0.5f * (p.y + 1.0f));
+    }
+
+    /**
+     * @brief Enable the compact storage used by the density and force passes
+     *
+     * Optional storage mode: the particles are mirrored in arrays sorted by cell, holding 16 bits offsets from the corner
+     * of their cell for the position, the velocity (16 bits each component when quantize_velocity, floats otherwise),
+     * the scale, the density and the pressure. The neighbours are then read from these arrays instead of their
+     * particle_element. Particles outside of the grid do not fit in their border cell and are read from their
+     * particle_element
+     *
+     * The mirror is encoded again at every sub-step, in an extra pass over the particles, and the passes are dominated
+     * by the arithmetic of each pair: this mode is not expected to be faster than the full storage (use
+     * measure_compact_storage to compare both on the current state). On a settled tank the quantization changes the
+     * densities by up to ~3e-5 (relative) and the forces by up to ~1.5e-2 of the weight of a particle
+     *
+     * @param enabled Whether the solver uses the compact storage
+     * @param quantize_velocity Whether the velocities are stored on 16 bits as well
+     */
+    void set_compact_storage(bool enabled, bool quantize_velocity);
+
+    inline bool has_compact_storage() const { return compact_storage; }
+    inline bool has_compact_velocity() const { return compact_velocity_storage; }
+
+    /**
+     * @brief Encode the positions, velocities and scales of the particles in the compact storage
+     *
+     * Must be called when the particles moved, before the compact queries
+     */
+    void update_compact_storage();
+
+    /**
+     * @brief Copy the densities and pressures of the particles in the compact storage
+     */
+    void update_compact_fields();
+
+    /**
+     * @brief Call a function on every particle closer than radius to a point, read from the compact storage
+     *
+     * Same neighbourhood as for_each_particle_in_radius. Positions are decoded on the fly, along periodic axes they are
+     * already the closest image of the particle
+     *
+     * @param center The center of the query
+     * @param radius The radius of the query (strict)
+     * @param callback Called with the slot of each particle found (see get_compact_slot) and its decoded position
+     */
+    template <typename F>
+    void for_each_compact_particle_in_radius(cgp::vec3 const& center, float radius, F&& callback) const;
+
+    /**
+     * @brief Get the slot of a particle in the compact storage
+     *
+     * @param k The index of the particle in get_all_particles()
+     */
+    inline int get_compact_slot(int k) const { return compact_slots[k]; }
+
+    inline cgp::vec3 get_compact_velocity(int slot) const {
+        if (compact_velocity_storage) {
+            compact_velocity const& v = compact_velocities[slot];
+            return cgp::vec3{velocity_quantum * v.x, velocity_quantum * v.y, 0.0f};
+        }
+        return cgp::vec3{compact_float_velocities[2 * slot], compact_float_velocities[2 * slot + 1], 0.0f};
+    }
+
+    inline float get_compact_scale(int slot) const { return compact_scales[slot]; }
+    inline float get_compact_rho(int slot) const { return compact_rho[slot]; }
+    inline float get_compact_pressure(int slot) const { return compact_pressure[slot]; }
+
+    /**
+     * @brief Benchmark every cell size (h, h/2, h/3) with and without far cell skipping on the current particles
+     * and keep the fastest
+     *
+     * Each configuration is timed on a real density pass of the simulation, so that the threads share the cells as
+     * they do during a step. The densities are overwritten (with the same values, the particles do not move)
+     *
+     * @param sph_parameters The parameters of the density pass
+     * @param repetitions The number of measures of each configuration (the best one is kept)
+     * @return The timings of every configuration
+     */
+    std::vector<grid_stencil_benchmark> auto_tune(sph_parameters_structure const& sph_parameters, int repetitions = 3);
+
     /**
      * @brief creates a grid with the given parameters
      *
+     * Along a periodic axis the padding is ignored and the spacing slightly adjusted, so that the particles tile the
+     * whole period
+     *
      * @param grid_init_param the parameters of the grid
      */
      void create_grid(grid_init_param const& grid_init_param);
 
     /**
-     * @brief clears the grid
+     * @brief clears the grid and frees its particles
      */
     void clear();
 
     /**
-     * @brief Add a particle to the grid
+     * @brief Add a particle to the grid, its position is wrapped along the periodic axes
      *
      * @param p The particle to add
      */
     void add_particle(particle_element *p);
 
+    /**
+     * @brief Remove and free the particles matching a predicate
+     *
+     * The remaining particles keep their order (and thus their memory locality and their index in the exports)
+     *
+     * @param predicate Called with each particle_element*, returns true if the particle must be removed
+     */
+    template <typename F>
+    void remove_particles_if(F&& predicate);
+
     /**
      * @brief a getter for the number of particles in the grid
      *
      * @return the number of particles in the grid
      */
-    inline unsigned long get_number_of_particles() { return particles.size(); }
+    inline unsigned long get_number_of_particles() const { return particles.size(); }
+
+    /**
+     * @brief a getter for the number of sleeping particles in the grid
+     *
+     * @return the number of particles currently asleep
+     */
+    unsigned long get_number_of_sleeping_particles();
+
+    /**
+     * @brief Wake up every particle of the grid
+     */
+    void wake_all_particles();
 
     /**
      * @brief Get particles
      *
-     * @return A vector of particles
+     * @return A view on the particles of the grid (no copy is made)
      */
-    inline std::vector<particle_element*> get_all_particles() { return particles; }
+    inline std::vector<particle_element*> const& get_all_particles() const { return particles; }
 
     /**
      * @brief Get all the particles influencing a particle
      *
+     * Allocates the returned vector, prefer for_each_particle_in_radius in loops
+     *
      * @param particle The particle
      * @return A vector of particles that influence the particle
      */
-     std::vector<particle_element*> get_particles_influencing(particle_element particle);
+     std::vector<particle_element*> get_particles_influencing(particle_element const& particle) const;
+
+    /**
+     * @brief Call a function on every particle closer than radius to a point
+     *
+     * The point does not need to be a particle and the radius can be larger than a cell. Nothing is allocated.
+     * Along periodic axes the particles are found across the edges, use minimum_image for their displacement
+     *
+     * @param center The center of the query
+     * @param radius The radius of the query (strict)
+     * @param callback Called with each particle_element* found
+     */
+    template <typename F>
+    void for_each_particle_in_radius(cgp::vec3 const& center, float radius, F&& callback) const;
+
+    /**
+     * @brief Call a function on every particle inside an axis aligned box
+     *
+     * Along periodic axes the box wraps across the edges, as the radius queries do: it may extend beyond [-1, 1) and
+     * the particles inside any image of it are found (each once)
+     *
+     * @param min The lower corner of the box
+     * @param max The upper corner of the box
+     * @param callback Called with each particle_element* found
+     */
+    template <typename F>
+    void for_each_particle_in_box(cgp::vec3 const& min, cgp::vec3 const& max, F&& callback) const;
+
+    /**
+     * @brief Find the k particles closest to a point
+     *
+     * Cells are visited by growing rings around the point until no closer particle can be found
+     *
+     * @param center The center of the query
+     * @param k The number of particles wanted
+     * @param nearest Caller provided storage for k particles, sorted by increasing distance on return
+     * @return The number of particles found (less than k only if the grid holds less than k particles)
+     */
+    int get_k_nearest(cgp::vec3 const& center, int k, particle_element** nearest) const;
 
     /**
      * @brief Update the position of all the particles in the grid
      */
     void update_particles();
+
+    /**
+     * @brief Rebuild the grid from the cell ids stored in get_cell_ids()
+     *
+     * Lets the integration kernel emit the cells while it already streams the particles, instead of recomputing them
+     * in an extra pass
+     */
+    void update_particles_from_cell_ids();
+
+    /**
+     * @brief Storage for the cell id of each particle
+     *
+     * @return A buffer holding one cell id per particle, in the order of get_all_particles()
+     */
+    std::vector<int>& get_cell_ids();
+
+    /**
+     * @brief Get the cell id of a position
+     *
+     * Coordinates outside the grid are clamped to the border cells, without branching so that it can be called from
+     * vectorized loops
+     *
+     * @param p The position
+     * @return The cell id (x * grid_size + y)
+     */
+    inline int get_cell_id(cgp::vec3 const& p) const {
+        int const x = std::max(0, std::min(static_cast<int>((p.x + 1.0f) * 0.5f * grid_size), grid_size - 1));
+        int const y = std::max(0, std::min(static_cast<int>((p.y + 1.0f) * 0.5f * grid_size), grid_size - 1));
+        return x * grid_size + y;
+    }
+
+    /**
+     * @brief Draw a random number from the generator of the grid
+     *
+     * Each grid owns its generator so that independent simulations can run concurrently and be reproduced from their
+     * seed
+     *
+     * @param min The lower bound
+     * @param max The upper bound
+     * @return A uniform random number in [min, max]
+     */
+    float random_interval(float min = 0.0f, float max = 1.0f);
 private:
+    float influence_radius;
+    int subdivision;
+    bool skip_far_cells;
+    bool periodic_x;
+    bool periodic_y;
+    bool compact_storage;
+    bool compact_velocity_storage;
+
     float cell_size;
     int grid_size;
 
+    std::mt19937 generator;
+
     std::vector<std::vector<std::vector<particle_element *>>> grid;
 
+    // The cell id of each particle, filled by the integration kernel
+    std::vector<int> cell_ids;
+
     // A vector referencing all the particles in the grid
     std::vector<particle_element*> particles;
 
+    // Compact storage, sorted by cell: the slots of cell c are [compact_cell_start[c], compact_cell_start[c + 1])
+    std::vector<int> compact_cell_start;
+    std::vector<int> compact_slots; // Slot of each particle, in the order of particles
+    std::vector<int> compact_next_slot; // Insertion point of each cell during the sort
+    std::vector<particle_element*> compact_particles; // Particle of each slot
+    std::vector<compact_position> compact_positions;
+    std::vector<compact_velocity> compact_velocities;
+    std::vector<float> compact_float_velocities; // (x, y) of each slot when the velocities are not quantized
+    std::vector<float> compact_scales;
+    std::vector<float> compact_rho;
+    std::vector<float> compact_pressure;
+    float velocity_quantum = 1.0f;
+
+    // Offsets of the particles that are outside of their cell (outside of the grid)
+    static uint16_t const compact_outside = 0xFFFF;
+
+    /**
+     * @brief Exchange the whole state of two grids, particles included
+     *
+     * @param other The other grid
+     */
+    void swap(Grid2d& other) noexcept;
+
     /**
      * @brief Get the cell coordinates of a particle
      *
      * @param p The particle
      * @return The cell coordinates
      */
-    std::pair<int, int> get_cell_coordinates(particle_element p);
-};
\ No newline at end of file
+    std::pair<int, int> get_cell_coordinates(particle_element const& p) const;
+
+    /**
+     * @brief Get the range of cells covering an interval along one axis
+     *
+     * @param min The lower bound of the interval
+     * @param max The upper bound of the interval
+     * @param periodic Whether the axis is periodic
+     * @param first The first cell index (clamped to the grid, as the particles outside of it are stored in the border).
+     * Along a periodic axis it is not clamped and must be wrapped with wrap_cell
+     * @param last The last cell index (clamped to the grid, or at most a period after first along a periodic axis)
+     */
+    inline void get_cell_range(float min, float max, bool periodic, int& first, int& last) const {
+        first = static_cast<int>(std::floor((min + 1.0f) * 0.5f * grid_size));
+        last = static_cast<int>(std::floor((max + 1.0f) * 0.5f * grid_size));
+        if (periodic) {
+            last = std::min(last, first + grid_size - 1); // Visit each cell once
+        } else {
+            first = std::max(0, std::min(first, grid_size - 1));
+            last = std::max(0, std::min(last, grid_size - 1));
+        }
+    }
+
+    inline int wrap_cell(int x) const {
+        return ((x % grid_size) + grid_size) % grid_size;
+    }
+
+    /**
+     * @brief Get the squared distance between a point and the closest point of a cell
+     *
+     * The cell indices are not wrapped: along periodic axes, a cell outside of the grid stands for the image of the
+     * wrapped cell. The border cells of non periodic axes extend to infinity, as they also store the particles outside
+     * of the grid
+     */
+    inline float get_cell_distance_squared(int x, int y, cgp::vec3 const& p) const {
+        float const width = 2.0f / static_cast<float>(grid_size);
+        float const min_x = x == 0 && !periodic_x ? -std::numeric_limits<float>::max() : -1.0f + x * width;
+        float const max_x = x == grid_size - 1 && !periodic_x ? std::numeric_limits<float>::max() : -1.0f + (x + 1) * width;
+        float const min_y = y == 0 && !periodic_y ? -std::numeric_limits<float>::max() : -1.0f + y * width;
+        float const max_y = y == grid_size - 1 && !periodic_y ? std::numeric_limits<float>::max() : -1.0f + (y + 1) * width;
+
+        float const dx = std::max(0.0f, std::max(min_x - p.x, p.x - max_x));
+        float const dy = std::max(0.0f, std::max(min_y - p.y, p.y - max_y));
+        return dx * dx + dy * dy;
+    }
+};
+
+template <typename F>
+void Grid2d::remove_particles_if(F&& predicate) {
+    for (auto& particle : particles) {
+        if (predicate(particle)) {
+            delete particle;
+            particle = nullptr;
+        }
+    }
+    particles.erase(std::remove(particles.begin(), particles.end(), nullptr), particles.end());
+
+    update_particles();
+}
+
+template <typename F>
+void Grid2d::for_each_particle_in_radius(cgp::vec3 const& center, float radius, F&& callback) const {
+    int min_x, max_x, min_y, max_y;
+    get_cell_range(center.x - radius, center.x + radius, periodic_x, min_x, max_x);
+    get_cell_range(center.y - radius, center.y + radius, periodic_y, min_y, max_y);
+
+    float const radius_squared = radius * radius;
+    for (int x = min_x; x <= max_x; ++x) {
+        int const cell_x = periodic_x ? wrap_cell(x) : x;
+        for (int y = min_y; y <= max_y; ++y) {
+            if (skip_far_cells && get_cell_distance_squared(x, y, center) >= radius_squared) {
+                continue;
+            }
+
+            int const cell_y = periodic_y ? wrap_cell(y) : y;
+            for (particle_element* particle : grid[cell_x][cell_y]) {
+                cgp::vec3 const d = minimum_image(particle->p - center);
+                if (d.x * d.x + d.y * d.y + d.z * d.z < radius_squared) {
+                    callback(particle);
+                }
+            }
+        }
+    }
+}
+
+template <typename F>
+void Grid2d::for_each_compact_particle_in_radius(cgp::vec3 const& center, float radius, F&& callback) const {
+    int min_x, max_x, min_y, max_y;
+    get_cell_range(center.x - radius, center.x + radius, periodic_x, min_x, max_x);
+    get_cell_range(center.y - radius, center.y + radius, periodic_y, min_y, max_y);
+
+    float const width = 2.0f / static_cast<float>(grid_size);
+    float const quantum = width / 65534.0f;
+    float const radius_squared = radius * radius;
+    for (int x = min_x; x <= max_x; ++x) {
+        int const cell_x = periodic_x ? wrap_cell(x) : x;
+        float const corner_x = -1.0f + x * width; // Unwrapped: the corner of the image of the cell
+        for (int y = min_y; y <= max_y; ++y) {
+            if (skip_far_cells && get_cell_distance_squared(x, y, center) >= radius_squared) {
+                continue;
+            }
+
+            int const cell_y = periodic_y ? wrap_cell(y) : y;
+            float const corner_y = -1.0f + y * width;
+            int const cell = cell_x * grid_size + cell_y;
+            for (int slot = compact_cell_start[cell]; slot < compact_cell_start[cell + 1]; ++slot) {
+                compact_position const offset = compact_positions[slot];
+
+                cgp::vec3 p;
+                if (offset.x != compact_outside) {
+                    p = cgp::vec3{corner_x + quantum * offset.x, corner_y + quantum * offset.y, 0.0f};
+                } else {
+                    p = center + minimum_image(compact_particles[slot]->p - center);
+                }
+
+                cgp::vec3 const d = p - center;
+                if (d.x * d.x + d.y * d.y < radius_squared) {
+                    callback(slot, p);
+                }
+            }
+        }
+    }
+}
+
+template <typename F>
+void Grid2d::for_each_particle_in_box(cgp::vec3 const& min, cgp::vec3 const& max, F&& callback) const {
+    int min_x, max_x, min_y, max_y;
+    get_cell_range(min.x, max.x, periodic_x, min_x, max_x);
+    get_cell_range(min.y, max.y, periodic_y, min_y, max_y);
+
+    // Along a periodic axis a coordinate is inside when one of its images is: its offset from the lower bound, wrapped
+    // into [0, 2), is at most the width of the box
+    auto const inside = [](float p, float lower, float upper, bool periodic) {
+        if (!periodic) {
+            return p >= lower && p <= upper;
+        }
+        float const offset = p - lower;
+        return offset - 2.0f * std::floor(0.5f * offset) <= upper - lower;
+    };
+
+    for (int x = min_x; x <= max_x; ++x) {
+        int const cell_x = periodic_x ? wrap_cell(x) : x;
+        for (int y = min_y; y <= max_y; ++y) {
+            int const cell_y = periodic_y ? wrap_cell(y) : y;
+            for (particle_element* particle : grid[cell_x][cell_y]) {
+                cgp::vec3 const& p = particle->p;
+                if (inside(p.x, min.x, max.x, periodic_x) && inside(p.y, min.y, max.y, periodic_y)) {
+                    callback(particle);
+                }
+            }
+        }
+    }
+}
\ No newline at end of file
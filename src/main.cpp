@@ -9,6 +9,12 @@
 // Custom scene of this code
 #include "scene.hpp"
 
+// Headless parameter sweeps and profiling
+#include "simulation/ensemble.hpp"
+#include "profiling/profiler.hpp"
+#include <cstdlib>
+#include <fstream>
+
 
 
 
@@ -27,13 +33,27 @@ scene_structure scene;
 window_structure standard_window_initialization(int width = 0, int height = 0);
 void initialize_default_shaders();
 void animation_loop();
+int run_sweep(std::string const& specification_file, std::string const& output_file);
+int run_profile(int frames, std::string const& output_file);
 
 timer_fps fps_record;
 
-int main(int, char* argv[])
+int main(int argc, char* argv[])
 {
 	std::cout << "Run " << argv[0] << std::endl;
 
+	// Batch mode: run a parameter sweep without opening any window
+	//  Usage: <executable> --sweep sweep.txt [results.csv]
+	if (argc > 2 && std::string(argv[1]) == "--sweep") {
+		return run_sweep(argv[2], argc > 3 ? argv[3] : "");
+	}
+
+	// Profiling mode: simulate without window and write a Chrome trace of the solver phases
+	//  Usage: <executable> --profile frames [trace.json]
+	if (argc > 2 && std::string(argv[1]) == "--profile") {
+		return run_profile(std::atoi(argv[2]), argc > 3 ? argv[3] : "profile_trace.json");
+	}
+
 	
 
 	// ************************ //
@@ -132,6 +152,67 @@ void animation_loop()
 }
 
 
+int run_sweep(std::string const& specification_file, std::string const& output_file)
+{
+	try {
+		sweep_specification const specification = load_sweep_specification(specification_file);
+		std::vector<ensemble_run> const runs = expand_sweep(specification);
+
+		std::cout << "Run " << runs.size() << " simulations of the sweep ..." << std::endl;
+		std::vector<ensemble_result> const results = run_ensemble(runs, specification);
+
+		if (output_file.empty()) {
+			write_results_table(std::cout, results);
+		}
+		else {
+			std::ofstream output(output_file);
+			write_results_table(output, results);
+			std::cout << "Results written in " << output_file << std::endl;
+		}
+	}
+	catch (std::exception const& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+int run_profile(int frames, std::string const& output_file)
+{
+	sph_parameters_structure sph_parameters;
+	time_step_parameters_structure time_step_parameters;
+	time_step_statistics time_step_stats;
+
+	Grid2d grid(sph_parameters);
+	grid.create_grid(grid_init_param());
+
+	cgp::grid_2D<vec3> field;
+	field.resize(30, 30);
+
+	std::cout << "Profile " << frames << " frames of " << grid.get_number_of_particles() << " particles ..." << std::endl;
+	Profiler::start();
+	for (int frame = 0; frame < frames; ++frame) {
+		simulate_frame(0.005f, grid, sph_parameters, time_step_parameters, time_step_stats);
+		update_field_color(field, grid, sph_parameters.h);
+	}
+	Profiler::stop();
+
+	if (!Profiler::has_hardware_counters()) {
+		std::cout << "Hardware counters unavailable (check /proc/sys/kernel/perf_event_paranoid), only timings are recorded" << std::endl;
+	}
+
+	if (!Profiler::write_chrome_trace(output_file)) {
+		std::cerr << "Cannot write " << output_file << std::endl;
+		return 1;
+	}
+	std::cout << "Trace written in " << output_file << std::endl;
+
+	return 0;
+}
+
+
 void initialize_default_shaders()
 {
 	// Generate the default directory from which the shaders are found
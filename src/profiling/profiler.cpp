@@ -0,0 +1,247 @@
+#include "profiler.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+std::atomic<bool> Profiler::enabled(false);
+
+namespace {
+
+    char const* const hardware_counter_names[NUMBER_OF_HARDWARE_COUNTERS] = {
+            "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+    };
+
+    struct trace_event {
+        char const* name;
+        double start_time; // microseconds since Profiler::start
+        double duration;   // microseconds
+        bool has_counters;
+        long long counters[NUMBER_OF_HARDWARE_COUNTERS];
+    };
+
+    // Events recorded by one thread, appended by their thread only. The mutex is only contended when
+    // Profiler::start clears the events or write_chrome_trace reads them
+    struct thread_track {
+        int id;
+        std::mutex mutex;
+        std::vector<trace_event> events;
+    };
+
+    // perf_event counters of the calling thread, opened on first use and closed when the thread exits
+    struct thread_counters {
+        int leader = -1;
+        int file_descriptors[NUMBER_OF_HARDWARE_COUNTERS];
+        int position_in_group[NUMBER_OF_HARDWARE_COUNTERS]; // -1 when the counter is not supported
+        int group_size = 0;
+
+        thread_counters() {
+            for (int k = 0; k < NUMBER_OF_HARDWARE_COUNTERS; ++k) {
+                file_descriptors[k] = -1;
+                position_in_group[k] = -1;
+            }
+#ifdef __linux__
+            uint32_t const types[NUMBER_OF_HARDWARE_COUNTERS] = {
+                    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+            };
+            uint64_t const configs[NUMBER_OF_HARDWARE_COUNTERS] = {
+                    PERF_COUNT_HW_CPU_CYCLES,
+                    PERF_COUNT_HW_INSTRUCTIONS,
+                    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                    PERF_COUNT_HW_CACHE_MISSES,
+                    PERF_COUNT_HW_BRANCH_MISSES
+            };
+
+            for (int k = 0; k < NUMBER_OF_HARDWARE_COUNTERS; ++k) {
+                perf_event_attr attributes = {};
+                attributes.size = sizeof(perf_event_attr);
+                attributes.type = types[k];
+                attributes.config = configs[k];
+                attributes.exclude_kernel = 1;
+                attributes.exclude_hv = 1;
+                attributes.read_format = PERF_FORMAT_GROUP;
+
+                // Count the calling thread on any CPU, all counters in one group so that they are read in one call
+                int const fd = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, leader, 0));
+                if (fd < 0) {
+                    continue;
+                }
+
+                if (leader < 0) {
+                    leader = fd;
+                }
+                file_descriptors[k] = fd;
+                position_in_group[k] = group_size++;
+            }
+
+            if (leader >= 0) {
+                ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+                ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+            }
+#endif
+        }
+
+        ~thread_counters() {
+#ifdef __linux__
+            for (int fd : file_descriptors) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+#endif
+        }
+
+        bool read(long long values[NUMBER_OF_HARDWARE_COUNTERS]) const {
+            if (leader < 0) {
+                return false;
+            }
+#ifdef __linux__
+            uint64_t buffer[1 + NUMBER_OF_HARDWARE_COUNTERS]; // number of counters followed by their values
+            if (::read(leader, buffer, sizeof(buffer)) <= 0) {
+                return false;
+            }
+
+            for (int k = 0; k < NUMBER_OF_HARDWARE_COUNTERS; ++k) {
+                values[k] = position_in_group[k] < 0 ? -1 : static_cast<long long>(buffer[1 + position_in_group[k]]);
+            }
+            return true;
+#else
+            (void) values;
+            return false;
+#endif
+        }
+    };
+
+    std::mutex tracks_mutex;
+    std::vector<std::unique_ptr<thread_track>> tracks;
+    std::atomic<long long> session_start(std::chrono::steady_clock::now().time_since_epoch().count()); // clock ticks
+    std::atomic<unsigned> session(0); // Incremented by each start, scopes opened during a previous session are dropped
+
+    thread_track& current_track() {
+        thread_local thread_track* track = nullptr;
+        if (track == nullptr) {
+            std::lock_guard<std::mutex> lock(tracks_mutex);
+            tracks.emplace_back(new thread_track());
+            track = tracks.back().get();
+            track->id = static_cast<int>(tracks.size()) - 1;
+        }
+
+        return *track;
+    }
+
+    thread_counters& current_counters() {
+        thread_local thread_counters counters;
+        return counters;
+    }
+
+    double elapsed_microseconds() {
+        std::chrono::steady_clock::duration const start(session_start.load(std::memory_order_acquire));
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch() - start).count();
+    }
+}
+
+void Profiler::start() {
+    // New session first, so that the scopes still open from the previous one do not record into the cleared tracks
+    session_start.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_release);
+    session.fetch_add(1, std::memory_order_acq_rel);
+
+    std::lock_guard<std::mutex> lock(tracks_mutex);
+    for (auto& track : tracks) {
+        std::lock_guard<std::mutex> track_lock(track->mutex);
+        track->events.clear();
+    }
+
+    enabled = true;
+}
+
+void Profiler::stop() {
+    enabled = false;
+}
+
+bool Profiler::has_hardware_counters() {
+    return current_counters().leader >= 0;
+}
+
+bool Profiler::write_chrome_trace(std::string const& filename) {
+    std::ofstream file(filename);
+    if (!file) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(tracks_mutex);
+
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    file << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"SPH solver\"}}";
+
+    for (auto const& track : tracks) {
+        file << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << track->id
+             << ", \"args\": {\"name\": \"thread " << track->id << "\"}}";
+
+        std::lock_guard<std::mutex> track_lock(track->mutex);
+
+        for (trace_event const& event : track->events) {
+            file << ",\n{\"name\": \"" << event.name << "\", \"cat\": \"sph\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                 << track->id << ", \"ts\": " << event.start_time << ", \"dur\": " << event.duration;
+
+            if (event.has_counters) {
+                file << ", \"args\": {";
+                bool first = true;
+                for (int k = 0; k < NUMBER_OF_HARDWARE_COUNTERS; ++k) {
+                    if (event.counters[k] < 0) {
+                        continue; // counter not supported
+                    }
+                    file << (first ? "" : ", ") << "\"" << hardware_counter_names[k] << "\": " << event.counters[k];
+                    first = false;
+                }
+                file << "}";
+            }
+            file << "}";
+        }
+    }
+
+    file << "\n]}\n";
+
+    return static_cast<bool>(file);
+}
+
+void ProfileScope::begin() {
+    start_session = session.load(std::memory_order_acquire);
+    current_counters().read(start_counters);
+    start_time = elapsed_microseconds();
+}
+
+void ProfileScope::end() {
+    // The scope was opened before a restart of the profiler, its start time belongs to the previous session
+    if (session.load(std::memory_order_acquire) != start_session) {
+        return;
+    }
+
+    double const end_time = elapsed_microseconds();
+
+    trace_event event;
+    event.name = name;
+    event.start_time = start_time;
+    event.duration = end_time - start_time;
+    event.has_counters = current_counters().read(event.counters);
+    if (event.has_counters) {
+        for (int k = 0; k < NUMBER_OF_HARDWARE_COUNTERS; ++k) {
+            if (event.counters[k] >= 0) {
+                event.counters[k] -= start_counters[k];
+            }
+        }
+    }
+
+    thread_track& track = current_track();
+    std::lock_guard<std::mutex> lock(track.mutex);
+    track.events.push_back(event);
+}
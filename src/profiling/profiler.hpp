@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+// Hardware counters sampled for every profiled scope
+enum hardware_counter {
+    CYCLES,
+    INSTRUCTIONS,
+    L1D_MISSES,
+    LLC_MISSES,
+    BRANCH_MISSES,
+    NUMBER_OF_HARDWARE_COUNTERS
+};
+
+/**
+ * @brief Records a timeline of the solver phases as Chrome trace events
+ *
+ * Every ProfileScope opened while the profiler is enabled becomes a complete event ("ph": "X") on the track of the
+ * thread that ran it. On Linux, the perf_event hardware counters of the thread (cycles, instructions, L1D/LLC misses,
+ * branch misses) are sampled at both ends of the scope and attached to the event. The timeline can be loaded in
+ * chrome://tracing or https://ui.perfetto.dev
+ *
+ * When the profiler is disabled a scope only costs a test of a boolean, and compiling with -DSPH_NO_PROFILING removes
+ * the scopes altogether
+ */
+class Profiler {
+public:
+    /**
+     * @brief Start recording, previous events are discarded
+     *
+     * Safe to call while other threads are inside profiled scopes: the scopes opened before the call are not recorded
+     */
+    static void start();
+
+    /**
+     * @brief Stop recording, the recorded events are kept until the next start
+     */
+    static void stop();
+
+    /**
+     * @brief Whether scopes are currently recorded
+     */
+    static inline bool is_enabled() { return enabled.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Whether the hardware counters could be opened on this machine
+     *
+     * perf_event may be unavailable (non Linux system, perf_event_paranoid, virtual machine), in which case only the
+     * timings are recorded
+     */
+    static bool has_hardware_counters();
+
+    /**
+     * @brief Write the recorded events in the Chrome trace-event JSON format
+     *
+     * @param filename The path of the output file
+     * @return false if the file could not be written
+     */
+    static bool write_chrome_trace(std::string const& filename);
+
+private:
+    friend class ProfileScope;
+
+    static std::atomic<bool> enabled;
+};
+
+/**
+ * @brief Records the enclosing scope as one event of the timeline
+ */
+class ProfileScope {
+public:
+    explicit inline ProfileScope(char const* name) : name(name), active(Profiler::is_enabled()) {
+        if (active) {
+            begin();
+        }
+    }
+
+    inline ~ProfileScope() {
+        if (active) {
+            end();
+        }
+    }
+
+    ProfileScope(ProfileScope const&) = delete;
+    ProfileScope& operator=(ProfileScope const&) = delete;
+
+private:
+    char const* name;
+    bool active;
+    unsigned start_session; // Profiler session the scope was opened in
+    double start_time;
+    long long start_counters[NUMBER_OF_HARDWARE_COUNTERS];
+
+    void begin();
+    void end();
+};
+
+#define PROFILE_CONCATENATE_DETAIL(a, b) a##b
+#define PROFILE_CONCATENATE(a, b) PROFILE_CONCATENATE_DETAIL(a, b)
+
+#ifndef SPH_NO_PROFILING
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCATENATE(profile_scope_, __LINE__)(name)
+#else
+#define PROFILE_SCOPE(name)
+#endif
@@ -1,23 +1,30 @@
 #include "scene.hpp"
+#include "profiling/profiler.hpp"
 
-void update_field_color(grid_2D<vec3>& field, Grid2d grid, float h) {
+void update_field_color(grid_2D<vec3>& field, Grid2d const& grid, float h) {
     field.fill({ 1,1,1 });
     float const d = 0.1f;
     int const Nf = int(field.dimension.x);
 
-    for (int kx = 0; kx < Nf; ++kx) {
-        for (int ky = 0; ky < Nf; ++ky) {
+    #pragma omp parallel
+    {
+        PROFILE_SCOPE("field update");
 
-            float f = 0.0f;
-            vec3 const p0 = { 2.0f * (kx / (Nf - 1.0f) - 0.5f), 2.0f * (ky / (Nf - 1.0f) - 0.5f), 0.0f };
+        #pragma omp for
+        for (int kx = 0; kx < Nf; ++kx) {
+            for (int ky = 0; ky < Nf; ++ky) {
 
-            for (auto particle: grid.get_all_particles()) {
-                vec3 const& pi = particle->p;
-                float const r = norm(p0 - pi) / d;
-                f += 2.0f * h * std::exp(-r * r);
-            }
+                float f = 0.0f;
+                vec3 const p0 = { 2.0f * (kx / (Nf - 1.0f) - 0.5f), 2.0f * (ky / (Nf - 1.0f) - 0.5f), 0.0f };
+
+                // Contributions beyond 3d are below exp(-9) and are skipped
+                grid.for_each_particle_in_radius(p0, 3.0f * d, [&](particle_element* particle) {
+                    float const r = norm(grid.minimum_image(p0 - particle->p)) / d;
+                    f += 2.0f * h * std::exp(-r * r);
+                });
 
-            field(kx, Nf - 1 - ky) = vec3(clamp(1 - f, 0, 1), clamp(1 - f, 0, 1), 1);
+                field(kx, Nf - 1 - ky) = vec3(clamp(1 - f, 0, 1), clamp(1 - f, 0, 1), 1);
+            }
         }
     }
 }
@@ -35,6 +42,7 @@ void scene_structure::initialize() {
 
     grid = Grid2d(sph_parameters);
     grid.create_grid(grid_init_param());
+    grid_benchmarks = grid.auto_tune(sph_parameters);
 
     sphere_particle.initialize_data_on_gpu(mesh_primitive_sphere(1.0,{0,0,0},10,10));
     sphere_particle.model.scaling = 0.01f;
@@ -52,12 +60,30 @@ void scene_structure::display_frame() {
     sph_parameters.h = 0.12f / gui.particle_scale;
     grid.resize(sph_parameters.h);
 
-    simulate(dt, grid, sph_parameters);
+    if (gui.solver == FLIP_SOLVER) {
+        flip_solver.simulate_frame(dt, grid, sph_parameters, flip_parameters, time_step_stats);
+    } else {
+        simulate_frame(dt, grid, sph_parameters, time_step_parameters, time_step_stats);
+    }
+    simulation_time += dt;
+    simulation_steps += time_step_stats.steps;
+
+    // The splitting criteria rely on the SPH densities
+    bool const adapt_resolution = resolution_parameters.enabled && gui.solver == SPH_SOLVER;
+    if (adapt_resolution && ++frames_since_adaptation >= resolution_parameters.interval) {
+        update_resolution(grid, sph_parameters, resolution_parameters, resolution_stats);
+        frames_since_adaptation = 0;
+    }
+
+    if (exporter.is_open()) {
+        exporter.publish(grid, simulation_time, simulation_steps);
+    }
 
     if (gui.display_particles) {
         for (auto particle: grid.get_all_particles()) {
             vec3 const& p = particle->p;
             sphere_particle.model.translation = p;
+            sphere_particle.model.scaling = 0.01f * particle->scale;
             draw(sphere_particle, environment);
         }
     }
@@ -65,7 +91,7 @@ void scene_structure::display_frame() {
     if (gui.display_radius) {
         curve_visual.model.scaling = sph_parameters.h;
 
-        auto particles = grid.get_all_particles(); // Get all particles
+        auto const& particles = grid.get_all_particles(); // Get all particles
         for (int i = 0; i < particles.size(); i += 10) {
             auto particle = particles[i]; // Get the particle at every 10th index
             curve_visual.model.translation = particle->p;
@@ -85,9 +111,30 @@ void scene_structure::display_gui() {
     ImGui::Text("FPS %.1f", ImGui::GetIO().Framerate);
     ImGui::Text("Number of particles %lu", grid.get_number_of_particles());
 
+    unsigned long const sleeping_particles = grid.get_number_of_sleeping_particles();
+    ImGui::Text("Active particles %lu", grid.get_number_of_particles() - sleeping_particles);
+    ImGui::Text("Sleeping particles %lu", sleeping_particles);
+
     ImGui::Checkbox("Display color", &gui.display_color);
     ImGui::Checkbox("Display particles", &gui.display_particles);
     ImGui::Checkbox("Display radius", &gui.display_radius);
+    ImGui::Checkbox("Sleeping particles", &sph_parameters.sleeping);
+
+    // The FLIP/PIC solver only has walls: the toggles are greyed out and ignored while it is selected
+    bool const periodic_available = gui.solver != FLIP_SOLVER;
+    bool periodic_x = grid.is_periodic_x();
+    bool periodic_y = grid.is_periodic_y();
+    if (!periodic_available) {
+        ImGui::PushStyleVar(ImGuiStyleVar_Alpha, 0.5f * ImGui::GetStyle().Alpha);
+    }
+    bool const periodic_x_changed = ImGui::Checkbox("Periodic X", &periodic_x);
+    bool const periodic_y_changed = ImGui::Checkbox("Periodic Y", &periodic_y);
+    if (!periodic_available) {
+        ImGui::PopStyleVar();
+        ImGui::TextDisabled("  Periodic boundaries are only supported by the SPH solver");
+    } else if (periodic_x_changed || periodic_y_changed) {
+        grid.set_periodic(periodic_x, periodic_y);
+    }
 
     if (ImGui::Button("Reset simulation")) {
         auto param = grid_init_param();
@@ -101,9 +148,136 @@ void scene_structure::display_gui() {
     }
 
     ImGui::SliderFloat("Particle scale", &gui.particle_scale, 1.0f, 3.0f, "%.3f", 1.0f);
+
+    bool profiling = Profiler::is_enabled();
+    if (ImGui::Checkbox("Record profile", &profiling)) {
+        if (profiling) {
+            Profiler::start();
+        } else {
+            Profiler::stop();
+        }
+    }
+    if (!profiling && ImGui::Button("Save profile trace")) {
+        Profiler::write_chrome_trace("profile_trace.json");
+    }
+
+    bool shared_memory_export = exporter.is_open();
+    if (ImGui::Checkbox("Publish to shared memory", &shared_memory_export)) {
+        if (shared_memory_export) {
+            exporter.open(PARTICLE_STREAM_DEFAULT_NAME, static_cast<unsigned int>(2 * grid.get_number_of_particles()));
+        } else {
+            exporter.close();
+        }
+    }
+    if (exporter.is_open()) {
+        ImGui::Text("  %s: %lu frames published", exporter.get_name().c_str(), exporter.get_published_frames());
+    }
+
+    ImGui::Checkbox("Mouse brush", &gui.brush);
+    if (gui.brush) {
+        ImGui::SliderFloat("Brush radius", &gui.brush_radius, 0.05f, 0.5f, "%.2f", 1.0f);
+        ImGui::SliderFloat("Brush strength", &gui.brush_strength, 1.0f, 50.0f, "%.1f", 1.0f);
+    }
+
+    int cell_size = grid.get_subdivision() - 1;
+    bool skip_far_cells = grid.get_skip_far_cells();
+    char const* const cell_sizes[] = { "h (3x3 stencil)", "h/2 (5x5 stencil)", "h/3 (7x7 stencil)" };
+    bool const cell_size_changed = ImGui::Combo("Cell size", &cell_size, cell_sizes, 3);
+    bool const skip_changed = ImGui::Checkbox("Skip far cells", &skip_far_cells);
+    if (cell_size_changed || skip_changed) {
+        grid.set_stencil(cell_size + 1, skip_far_cells);
+    }
+    if (ImGui::Button("Auto-tune grid")) {
+        grid_benchmarks = grid.auto_tune(sph_parameters);
+    }
+    for (auto const& benchmark : grid_benchmarks) {
+        ImGui::Text("  h/%d%s: %.3f ms", benchmark.subdivision, benchmark.skip_far_cells ? " skip" : "", benchmark.milliseconds);
+    }
+
+    bool compact_storage = grid.has_compact_storage();
+    bool compact_velocity = grid.has_compact_velocity();
+    bool const compact_changed = ImGui::Checkbox("Compact storage (16-bit positions)", &compact_storage);
+    bool const velocity_changed = compact_storage && ImGui::Checkbox("16-bit velocities", &compact_velocity);
+    if (compact_changed || velocity_changed) {
+        grid.set_compact_storage(compact_storage, compact_velocity);
+    }
+    if (ImGui::Button("Measure compact accuracy")) {
+        compact_report = measure_compact_storage(grid, sph_parameters);
+        compact_report_available = true;
+    }
+    if (compact_report_available) {
+        ImGui::Text("  density error: max %.2e, mean %.2e", compact_report.max_density_error, compact_report.mean_density_error);
+        ImGui::Text("  force error: max %.2e, mean %.2e", compact_report.max_force_error, compact_report.mean_force_error);
+        ImGui::Text("  full %.3f ms, compact %.3f ms", compact_report.full_milliseconds, compact_report.compact_milliseconds);
+    }
+
+    ImGui::Checkbox("Adaptive resolution", &resolution_parameters.enabled);
+    if (resolution_parameters.enabled) {
+        ImGui::SliderFloat("Surface threshold", &resolution_parameters.surface_threshold, 0.1f, 2.0f, "%.2f", 1.0f);
+        ImGui::SliderFloat("Vorticity threshold", &resolution_parameters.vorticity_threshold, 1.0f, 100.0f, "%.1f", 1.0f);
+
+        unsigned long const uniform = resolution_stats.uniform_equivalent;
+        unsigned long const particles = grid.get_number_of_particles();
+        ImGui::Text("Uniform resolution would need %lu particles (%lu saved)", uniform,
+                    uniform > particles ? uniform - particles : 0ul);
+        ImGui::Text("Last adaptation: %lu splits, %lu merges", resolution_stats.splits, resolution_stats.merges);
+    }
+
+    ImGui::SliderFloat("Time scale", &timer.scale, 0.1f, 4.0f, "%.2f", 1.0f);
+
+    char const* const solvers[] = { "SPH", "FLIP/PIC" };
+    if (ImGui::Combo("Solver", &gui.solver, solvers, 2) && gui.solver == FLIP_SOLVER) {
+        grid.set_periodic(false, false); // The MAC grid of the FLIP/PIC solver is bounded by walls
+    }
+    if (gui.solver == FLIP_SOLVER) {
+        ImGui::SliderFloat("FLIP ratio", &flip_parameters.flip_ratio, 0.0f, 1.0f, "%.2f", 1.0f);
+        ImGui::SliderFloat("MAC cell size (h)", &flip_parameters.cell_size, 1.0f, 4.0f, "%.1f", 1.0f);
+        ImGui::SliderFloat("Grid CFL", &flip_parameters.cfl, 0.2f, 3.0f, "%.2f", 1.0f);
+        ImGui::SliderFloat("Density correction", &flip_parameters.density_correction, 0.0f, 0.8f, "%.2f", 1.0f);
+
+        flip_statistics const& flip_stats = flip_solver.get_statistics();
+        ImGui::Text("Pressure solve: %d iterations, %d fluid cells", flip_stats.iterations, flip_stats.fluid_cells);
+        ImGui::Text("Largest density error: %.0f%%", 100 * flip_stats.max_density_error);
+    } else {
+        ImGui::Checkbox("Adaptive time step", &time_step_parameters.adaptive);
+        if (time_step_parameters.adaptive) {
+            ImGui::SliderFloat("CFL", &time_step_parameters.cfl, 0.05f, 1.0f, "%.2f", 1.0f);
+            ImGui::Checkbox("Multi-rate sub-steps", &time_step_parameters.multi_rate);
+            if (time_step_parameters.multi_rate) {
+                ImGui::SliderInt("Max sub-step level", &time_step_parameters.max_level, 0, max_time_step_levels - 1);
+            }
+        }
+    }
+
+    ImGui::Text("dt %.5f (%d steps per frame)", time_step_stats.dt, time_step_stats.steps);
+
+    float level_histogram[max_time_step_levels];
+    for (int level = 0; level < max_time_step_levels; ++level) {
+        level_histogram[level] = static_cast<float>(time_step_stats.level_histogram[level]);
+    }
+    ImGui::PlotHistogram("Particles per level", level_histogram, max_time_step_levels);
 }
 
-void scene_structure::mouse_move_event() {}
+vec3 scene_structure::mouse_world_position(vec2 const& mouse_position) const {
+    vec4 const p = camera_control.camera_model.matrix_frame() * camera_projection.matrix_inverse() *
+                   vec4(mouse_position.x, mouse_position.y, 0.0f, 1.0f);
+    return vec3{p.x, p.y, 0.0f};
+}
+
+void scene_structure::mouse_move_event() {
+    if (!gui.brush || !inputs.mouse.click.left || inputs.mouse.on_gui) {
+        return;
+    }
+
+    // Push the fluid under the brush along the motion of the mouse
+    vec3 const current = mouse_world_position(inputs.mouse.position.current);
+    vec3 const push = gui.brush_strength * (current - mouse_world_position(inputs.mouse.position.previous));
+
+    grid.for_each_particle_in_radius(current, gui.brush_radius, [&](particle_element* particle) {
+        particle->wake();
+        particle->v += push;
+    });
+}
 
 void scene_structure::mouse_click_event() {
     camera_control.action_mouse_click(environment.camera_view);
@@ -112,21 +286,25 @@ void scene_structure::mouse_click_event() {
 void scene_structure::keyboard_event() {
     if (ImGui::IsKeyDown('A')) {
         for (auto particle: grid.get_all_particles()) {
+            particle->wake();
             particle->v += vec3{-0.1f, 0, 0};
         }
     }
     if (ImGui::IsKeyDown('D')) {
         for (auto particle: grid.get_all_particles()) {
+            particle->wake();
             particle->v += vec3{0.1f, 0, 0};
         }
     }
     if (ImGui::IsKeyDown('W')) {
         for (auto particle: grid.get_all_particles()) {
+            particle->wake();
             particle->v += vec3{0, 0.1f, 0};
         }
     }
     if (ImGui::IsKeyDown('S')) {
         for (auto particle: grid.get_all_particles()) {
+            particle->wake();
             particle->v += vec3{0, -0.1f, 0};
         }
     }
@@ -3,14 +3,30 @@
 #include "cgp/cgp.hpp"
 #include "environment.hpp"
 #include "grid2D.hpp"
+#include "simulation/adaptive_resolution.hpp"
+#include "simulation/flip.hpp"
+#include "export/shared_memory_exporter.hpp"
 
 using cgp::mesh_drawable;
 
+// Fill the field color from the particles around each of its pixels
+void update_field_color(cgp::grid_2D<cgp::vec3>& field, Grid2d const& grid, float h);
+
+// Solvers advancing the particles
+enum fluid_solver {
+    SPH_SOLVER,
+    FLIP_SOLVER
+};
+
 struct gui_parameters {
     bool display_color = true;
     bool display_particles = false;
     bool display_radius = false;
     float particle_scale = 2.0f;
+    bool brush = false;          // Drag with the left button to push the fluid
+    float brush_radius = 0.15f;
+    float brush_strength = 10.0f;
+    int solver = SPH_SOLVER;     // One of fluid_solver
 };
 
 // The structure of the custom scene
@@ -33,7 +49,20 @@ struct scene_structure: cgp::scene_inputs_generic {
     cgp::timer_basic timer;
 
     sph_parameters_structure sph_parameters; // Physical parameter related to SPH
+    time_step_parameters_structure time_step_parameters; // Adaptive time stepping parameters
+    time_step_statistics time_step_stats;     // Time steps chosen during the last frame
+    resolution_parameters_structure resolution_parameters; // Splitting and merging of the particles
+    resolution_statistics resolution_stats;   // Result of the last adaptation
+    int frames_since_adaptation = 0;
+    FlipSolver flip_solver;                   // Grid based solver, used instead of SPH when selected
+    flip_parameters_structure flip_parameters;
     Grid2d grid = Grid2d(sph_parameters_structure());      // Storage of the particles
+    std::vector<grid_stencil_benchmark> grid_benchmarks;   // Timings of the last grid auto-tuning
+    compact_storage_report compact_report;    // Accuracy of the compact storage, last measure
+    bool compact_report_available = false;
+    SharedMemoryExporter exporter;            // Publishes the particles to other processes
+    double simulation_time = 0;               // Simulated time since the start
+    unsigned long simulation_steps = 0;       // Solver steps since the start
 
     cgp::mesh_drawable sphere_particle; // Sphere used to display a particle
     cgp::curve_drawable curve_visual;   // Circle used to display the radius h of influence
@@ -49,6 +78,8 @@ struct scene_structure: cgp::scene_inputs_generic {
     void display_frame(); // The frame display to be called within the animation loop
     void display_gui();   // The display of the GUI, also called within the animation loop
 
+    cgp::vec3 mouse_world_position(cgp::vec2 const& mouse_position) const; // Position in the plane z=0 under the mouse
+
     void mouse_move_event();
     void mouse_click_event();
     void keyboard_event();
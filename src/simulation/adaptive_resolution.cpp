@@ -0,0 +1,198 @@
+#include "adaptive_resolution.hpp"
+#include "grid2D.hpp"
+
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+using namespace cgp;
+
+void update_resolution(Grid2d &grid, sph_parameters_structure const& sph_parameters,
+                       resolution_parameters_structure const& resolution_parameters, resolution_statistics &statistics) {
+    float const h = sph_parameters.h;
+    float const split_scale = resolution_parameters.min_scale * std::sqrt(2.0f); // Smallest scale that can still be split
+    float const scale_tolerance = 1e-3f;
+    int const split_directions = 8; // Number of directions tried to place the children of a split
+
+    statistics.splits = 0;
+    statistics.merges = 0;
+
+    // Copy, as the particles are added and removed below
+    std::vector<particle_element*> const particles = grid.get_all_particles();
+    int const N = static_cast<int>(particles.size());
+
+    // Free surface and vorticity indicators of every particle
+    std::vector<float> surface(N);
+    std::vector<float> vorticity(N);
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < N; ++i) {
+        particle_element const* particle = particles[i];
+        float const h_i = particle_h(*particle, sph_parameters);
+
+        vec3 color_gradient = {0, 0, 0};
+        float curl = 0.0f;
+
+        grid.for_each_particle_in_radius(particle->p, h, [&](particle_element* neighbour) {
+            vec3 const p_j = particle->p - grid.minimum_image(particle->p - neighbour->p);
+
+            float const h_ij = 0.5f * (h_i + particle_h(*neighbour, sph_parameters));
+            if (neighbour == particle || norm(particle->p - p_j) >= h_ij) {
+                return;
+            }
+
+            vec3 const gradient = planar_kernel_factor(h_ij, sph_parameters) * W_gradient_pressure(particle->p, p_j, h_ij);
+            float const volume = particle_mass(*neighbour, sph_parameters) / neighbour->rho;
+            vec3 const dv = neighbour->v - particle->v;
+
+            color_gradient += volume * gradient;
+            curl += volume * (dv.x * gradient.y - dv.y * gradient.x);
+        });
+
+        // The color field is ~1 inside the fluid and drops to 0 across the surface: its gradient is ~1/h there
+        surface[i] = norm(color_gradient) * h_i;
+        vorticity[i] = std::abs(curl);
+    }
+
+    // Children must not be pushed through the walls (bottom, left and right, as in the integration)
+    float const wall_margin = 1e-3f;
+    auto const keep_inside = [&](vec3& p) {
+        if (!grid.is_periodic_x()) {
+            p.x = std::min(std::max(p.x, -1.0f + wall_margin), 1.0f - wall_margin);
+        }
+        if (!grid.is_periodic_y()) {
+            p.y = std::max(p.y, -1.0f + wall_margin);
+        }
+    };
+
+    std::unordered_map<particle_element const*, int> index;
+    for (int i = 0; i < N; ++i) {
+        index[particles[i]] = i;
+    }
+
+    auto const can_merge = [&](int i) {
+        particle_element const* particle = particles[i];
+        return particle->scale > 0 && particle->scale < 1.0f - scale_tolerance &&
+               surface[i] < resolution_parameters.surface_threshold &&
+               vorticity[i] < 0.5f * resolution_parameters.vorticity_threshold &&
+               norm(particle->v) < resolution_parameters.merge_velocity;
+    };
+
+    for (int i = 0; i < N; ++i) {
+        particle_element* particle = particles[i];
+
+        bool const interesting = surface[i] >= resolution_parameters.surface_threshold ||
+                                 vorticity[i] >= resolution_parameters.vorticity_threshold;
+
+        if (interesting && !particle->sleeping && particle->scale >= split_scale - scale_tolerance) {
+            // Split in two children of half the mass, placed along the direction where they overlap the least with
+            // the neighbours so that the density does not jump around the children
+            float const h_parent = particle_h(*particle, sph_parameters);
+            float const h_child = h_parent / std::sqrt(2.0f);
+            float const spread = 0.25f * h_parent;
+
+            vec3 direction = {1, 0, 0};
+            float lowest_overlap = std::numeric_limits<float>::max();
+            for (int k = 0; k < split_directions; ++k) {
+                float const angle = Pi * static_cast<float>(k) / static_cast<float>(split_directions);
+                vec3 const candidate = {std::cos(angle), std::sin(angle), 0};
+
+                float overlap = 0.0f;
+                grid.for_each_particle_in_radius(particle->p, h, [&](particle_element* neighbour) {
+                    if (neighbour == particle) {
+                        return;
+                    }
+
+                    vec3 const d = grid.minimum_image(neighbour->p - particle->p);
+                    for (float side : {-1.0f, 1.0f}) {
+                        vec3 const r = d - side * spread * candidate;
+                        float const r2 = dot(r, r);
+                        if (r2 < h_child * h_child) {
+                            overlap += std::pow(h_child * h_child - r2, 3.0f);
+                        }
+                    }
+                });
+
+                if (overlap < lowest_overlap) {
+                    lowest_overlap = overlap;
+                    direction = candidate;
+                }
+            }
+
+            vec3 const offset = spread * direction;
+            particle->scale /= std::sqrt(2.0f);
+
+            auto *child = new particle_element(*particle);
+            child->p += offset;
+            particle->p -= offset;
+            keep_inside(child->p);
+            keep_inside(particle->p);
+            grid.wrap_position(particle->p);
+            grid.add_particle(child);
+
+            statistics.splits++;
+        } else if (can_merge(i)) {
+            // Merge with the calm interior particle of the same scale whose merged position is the least crowded
+            float const h_i = particle_h(*particle, sph_parameters);
+            float const h_merged = std::min(1.0f, std::sqrt(2.0f) * particle->scale) * h;
+            particle_element* partner = nullptr;
+            float lowest_overlap = std::numeric_limits<float>::max();
+
+            grid.for_each_particle_in_radius(particle->p, h_i, [&](particle_element* candidate) {
+                auto const it = index.find(candidate);
+                if (candidate == particle || it == index.end() || !can_merge(it->second) ||
+                    std::abs(candidate->scale - particle->scale) > scale_tolerance) {
+                    return;
+                }
+
+                vec3 const middle = particle->p + 0.5f * grid.minimum_image(candidate->p - particle->p);
+                float overlap = 0.0f;
+                grid.for_each_particle_in_radius(middle, h_merged, [&](particle_element* neighbour) {
+                    if (neighbour == particle || neighbour == candidate || neighbour->scale <= 0) {
+                        return;
+                    }
+                    vec3 const d = grid.minimum_image(neighbour->p - middle);
+                    float const r2 = dot(d, d);
+                    if (r2 < h_merged * h_merged) {
+                        overlap += std::pow(h_merged * h_merged - r2, 3.0f);
+                    }
+                });
+
+                if (overlap < lowest_overlap) {
+                    lowest_overlap = overlap;
+                    partner = candidate;
+                }
+            });
+
+            if (partner == nullptr) {
+                continue;
+            }
+
+            // Conserve mass and momentum
+            float const m_i = particle_mass(*particle, sph_parameters);
+            float const m_j = particle_mass(*partner, sph_parameters);
+            float const w_i = m_i / (m_i + m_j);
+            float const w_j = m_j / (m_i + m_j);
+
+            particle->p += w_j * grid.minimum_image(partner->p - particle->p);
+            grid.wrap_position(particle->p);
+            particle->v = w_i * particle->v + w_j * partner->v;
+            particle->rho = w_i * particle->rho + w_j * partner->rho;
+            particle->pressure = w_i * particle->pressure + w_j * partner->pressure;
+            particle->scale = std::min(1.0f, std::sqrt(particle->scale * particle->scale + partner->scale * partner->scale));
+            particle->wake();
+
+            partner->scale = 0; // Marked for removal
+            statistics.merges++;
+        }
+    }
+
+    grid.remove_particles_if([](particle_element* particle) { return particle->scale <= 0; });
+
+    float uniform_equivalent = 0.0f;
+    for (auto particle : grid.get_all_particles()) {
+        float const ratio = particle->scale / resolution_parameters.min_scale;
+        uniform_equivalent += ratio * ratio;
+    }
+    statistics.uniform_equivalent = static_cast<unsigned long>(uniform_equivalent + 0.5f);
+}
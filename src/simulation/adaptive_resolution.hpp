@@ -0,0 +1,38 @@
+#pragma once
+
+#include "simulation.hpp"
+
+struct resolution_parameters_structure {
+    bool enabled = false; // Split and merge particles depending on the flow
+
+    float min_scale = 0.5f; // Finest resolution allowed (a particle of scale s has a smoothing length s h)
+
+    float surface_threshold = 0.5f; // Norm of the color field gradient (times h) above which a particle is on the surface
+
+    float vorticity_threshold = 20.0f; // Vorticity above which a particle is split
+
+    float merge_velocity = 0.2f; // Speed under which interior particles are considered calm enough to be merged
+
+    int interval = 10; // Number of frames between two adaptations
+};
+
+struct resolution_statistics {
+    unsigned long splits = 0; // Number of particles split during the last adaptation
+
+    unsigned long merges = 0; // Number of pairs merged during the last adaptation
+
+    unsigned long uniform_equivalent = 0; // Number of particles needed to fill the same mass at the finest resolution
+};
+
+/**
+ * @brief Adapt the resolution of the particles to the flow
+ *
+ * Particles on the free surface (large color field gradient) or in high vorticity regions are split in two children of
+ * half their mass (scale / sqrt(2)), down to min_scale, placed along the direction where they overlap the least with
+ * their neighbours and kept inside the walls. Pairs of calm interior particles of the same refined scale are merged
+ * back into one particle, conserving mass and momentum, the partner being chosen so that the merged particle lands in
+ * the least crowded place. The kernels being rescaled per pair (see planar_kernel_factor), both keep the density
+ * continuous. The grid is rebuilt afterwards
+ */
+void update_resolution(Grid2d &grid, sph_parameters_structure const& sph_parameters,
+                       resolution_parameters_structure const& resolution_parameters, resolution_statistics &statistics);
@@ -0,0 +1,207 @@
+#include "ensemble.hpp"
+#include "grid2D.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace cgp;
+
+template <typename T>
+std::vector<T> parse_values(std::istringstream& stream, std::string const& key) {
+    std::vector<T> values;
+    T value;
+    while (stream >> value) {
+        values.push_back(value);
+    }
+
+    if (values.empty()) {
+        throw std::runtime_error("Sweep specification: no value given for " + key);
+    }
+
+    return values;
+}
+
+sweep_specification load_sweep_specification(std::string const& filename) {
+    std::ifstream file(filename);
+    if (!file) {
+        throw std::runtime_error("Sweep specification: cannot open " + filename);
+    }
+
+    sweep_specification specification;
+
+    std::string line;
+    while (std::getline(file, line)) {
+        // Skip comments and empty lines
+        line = line.substr(0, line.find('#'));
+        size_t const separator = line.find('=');
+        if (separator == std::string::npos) {
+            if (line.find_first_not_of(" \t\r") != std::string::npos) {
+                throw std::runtime_error("Sweep specification: expected \"key = values\" in \"" + line + "\"");
+            }
+            continue;
+        }
+
+        std::istringstream key_stream(line.substr(0, separator));
+        std::string key;
+        key_stream >> key;
+        std::istringstream values(line.substr(separator + 1));
+
+        if (key == "h") {
+            specification.h = parse_values<float>(values, key);
+        } else if (key == "rho0") {
+            specification.rho0 = parse_values<float>(values, key);
+        } else if (key == "nu") {
+            specification.nu = parse_values<float>(values, key);
+        } else if (key == "stiffness") {
+            specification.stiffness = parse_values<float>(values, key);
+        } else if (key == "seeds") {
+            specification.seeds = parse_values<unsigned int>(values, key);
+        } else if (key == "frames") {
+            specification.frames = parse_values<int>(values, key).front();
+        } else if (key == "frame_dt") {
+            specification.frame_dt = parse_values<float>(values, key).front();
+        } else if (key == "adaptive") {
+            specification.time_step_parameters.adaptive = parse_values<int>(values, key).front() != 0;
+        } else if (key == "multi_rate") {
+            specification.time_step_parameters.multi_rate = parse_values<int>(values, key).front() != 0;
+        } else if (key == "periodic_x") {
+            specification.periodic_x = parse_values<int>(values, key).front() != 0;
+        } else if (key == "periodic_y") {
+            specification.periodic_y = parse_values<int>(values, key).front() != 0;
+        } else if (key == "threads") {
+            specification.threads = parse_values<unsigned int>(values, key).front();
+        } else {
+            throw std::runtime_error("Sweep specification: unknown key " + key);
+        }
+    }
+
+    return specification;
+}
+
+std::vector<ensemble_run> expand_sweep(sweep_specification const& specification) {
+    std::vector<ensemble_run> runs;
+
+    for (float h : specification.h) {
+        for (float rho0 : specification.rho0) {
+            for (float nu : specification.nu) {
+                for (float stiffness : specification.stiffness) {
+                    for (unsigned int seed : specification.seeds) {
+                        ensemble_run run;
+                        run.sph_parameters.h = h;
+                        run.sph_parameters.rho0 = rho0;
+                        run.sph_parameters.m = rho0 * h * h;
+                        run.sph_parameters.nu = nu;
+                        run.sph_parameters.stiffness = stiffness;
+                        run.seed = seed;
+
+                        runs.push_back(run);
+                    }
+                }
+            }
+        }
+    }
+
+    return runs;
+}
+
+float max_density_error(Grid2d &grid, float rho0) {
+    float error = 0.0f;
+    for (auto particle : grid.get_all_particles()) {
+        error = std::max(error, std::abs(particle->rho - rho0) / rho0);
+    }
+
+    return error;
+}
+
+float total_energy(Grid2d &grid, sph_parameters_structure const& sph_parameters) {
+    float const gravity = 9.81f;
+
+    float energy = 0.0f;
+    for (auto particle : grid.get_all_particles()) {
+        float const m = particle_mass(*particle, sph_parameters);
+        energy += 0.5f * m * dot(particle->v, particle->v) + m * gravity * (particle->p.y + 1.0f);
+    }
+
+    return energy;
+}
+
+ensemble_result run_single(ensemble_run const& run, sweep_specification const& specification) {
+    ensemble_result result;
+    result.run = run;
+
+    auto const start = std::chrono::steady_clock::now();
+
+    Grid2d grid(run.sph_parameters);
+    grid.set_periodic(specification.periodic_x, specification.periodic_y);
+    grid_init_param param;
+    param.seed = run.seed;
+    grid.create_grid(param);
+
+    time_step_statistics statistics;
+    for (int frame = 0; frame < specification.frames; ++frame) {
+        simulate_frame(specification.frame_dt, grid, run.sph_parameters, specification.time_step_parameters, statistics);
+        result.max_density_error = std::max(result.max_density_error, max_density_error(grid, run.sph_parameters.rho0));
+    }
+
+    result.number_of_particles = grid.get_number_of_particles();
+    result.final_energy = total_energy(grid, run.sph_parameters);
+    result.wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return result;
+}
+
+std::vector<ensemble_result> run_ensemble(std::vector<ensemble_run> const& runs, sweep_specification const& specification) {
+    std::vector<ensemble_result> results(runs.size());
+
+    unsigned int threads = specification.threads;
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min<unsigned int>(threads, static_cast<unsigned int>(runs.size()));
+
+    // Each worker picks the next pending run until none is left
+    std::atomic<size_t> next_run(0);
+    auto worker = [&]() {
+#ifdef _OPENMP
+        // The runs already occupy every core, keep the loops of each run sequential
+        omp_set_num_threads(1);
+#endif
+        for (size_t k = next_run++; k < runs.size(); k = next_run++) {
+            results[k] = run_single(runs[k], specification);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int k = 0; k < threads; ++k) {
+        workers.emplace_back(worker);
+    }
+    for (auto& thread : workers) {
+        thread.join();
+    }
+
+    return results;
+}
+
+void write_results_table(std::ostream& out, std::vector<ensemble_result> const& results) {
+    out << "run,h,rho0,nu,stiffness,seed,particles,final_energy,max_density_error,wall_time\n";
+
+    for (size_t k = 0; k < results.size(); ++k) {
+        ensemble_result const& result = results[k];
+        sph_parameters_structure const& parameters = result.run.sph_parameters;
+
+        out << k << ','
+            << parameters.h << ',' << parameters.rho0 << ',' << parameters.nu << ',' << parameters.stiffness << ','
+            << result.run.seed << ',' << result.number_of_particles << ','
+            << result.final_energy << ',' << result.max_density_error << ',' << result.wall_time << '\n';
+    }
+}
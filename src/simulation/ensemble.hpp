@@ -0,0 +1,78 @@
+#pragma once
+
+#include "simulation.hpp"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Description of a parameter sweep
+ *
+ * Every combination of the listed values (h x rho0 x nu x stiffness x seeds) is simulated independently
+ */
+struct sweep_specification {
+    std::vector<float> h = {sph_parameters_structure().h};
+    std::vector<float> rho0 = {sph_parameters_structure().rho0};
+    std::vector<float> nu = {sph_parameters_structure().nu};
+    std::vector<float> stiffness = {sph_parameters_structure().stiffness};
+    std::vector<unsigned int> seeds = {0};
+
+    int frames = 1000; // Number of frames simulated by each run
+    float frame_dt = 0.005f; // Simulated time of a frame
+
+    time_step_parameters_structure time_step_parameters;
+
+    bool periodic_x = false; // Connect the left and right edges of the domain
+    bool periodic_y = false; // Connect the bottom and top edges of the domain
+
+    unsigned int threads = 0; // Number of concurrent runs (0 uses every core)
+};
+
+/**
+ * @brief Parameters of a single run of the ensemble
+ */
+struct ensemble_run {
+    sph_parameters_structure sph_parameters;
+    unsigned int seed;
+};
+
+/**
+ * @brief Summary metrics of a finished run
+ */
+struct ensemble_result {
+    ensemble_run run;
+
+    unsigned long number_of_particles = 0;
+    float final_energy = 0.0f;       // Kinetic + gravitational potential energy at the end of the run
+    float max_density_error = 0.0f;  // Largest |rho - rho0| / rho0 seen during the run
+    double wall_time = 0.0;          // Seconds spent simulating the run
+};
+
+/**
+ * @brief Read a sweep specification
+ *
+ * The file contains one "key = value value ..." line per entry, lines starting with # are ignored. Keys are h, rho0,
+ * nu, stiffness, seeds, frames, frame_dt, adaptive, multi_rate, periodic_x, periodic_y and threads
+ *
+ * @param filename The path of the specification
+ * @return The parsed specification, throws std::runtime_error on a malformed file
+ */
+sweep_specification load_sweep_specification(std::string const& filename);
+
+/**
+ * @brief Expand a specification into the list of its runs
+ */
+std::vector<ensemble_run> expand_sweep(sweep_specification const& specification);
+
+/**
+ * @brief Simulate every run concurrently, each one with its own Grid2d and seed
+ *
+ * @return The results, in the same order as the runs
+ */
+std::vector<ensemble_result> run_ensemble(std::vector<ensemble_run> const& runs, sweep_specification const& specification);
+
+/**
+ * @brief Write the results as a CSV table
+ */
+void write_results_table(std::ostream& out, std::vector<ensemble_result> const& results);
@@ -0,0 +1,515 @@
+#include "flip.hpp"
+#include "grid2D.hpp"
+#include "profiling/profiler.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace cgp;
+
+namespace {
+
+    // Bilinear weights of the four values of a staggered field surrounding a position
+    struct bilinear_stencil {
+        int index[4];
+        float weight[4];
+    };
+
+    // The field holds nx x ny values (index i * ny + j), the value (i, j) sits at (-1 + (i + ox) dx, -1 + (j + oy) dx)
+    inline bilinear_stencil get_stencil(vec3 const& p, int nx, int ny, float ox, float oy, float dx) {
+        float const gx = (p.x + 1.0f) / dx - ox;
+        float const gy = (p.y + 1.0f) / dx - oy;
+        int const i = std::max(0, std::min(static_cast<int>(std::floor(gx)), nx - 2));
+        int const j = std::max(0, std::min(static_cast<int>(std::floor(gy)), ny - 2));
+        float const fx = std::max(0.0f, std::min(gx - i, 1.0f));
+        float const fy = std::max(0.0f, std::min(gy - j, 1.0f));
+
+        bilinear_stencil stencil;
+        stencil.index[0] = i * ny + j;
+        stencil.index[1] = (i + 1) * ny + j;
+        stencil.index[2] = i * ny + j + 1;
+        stencil.index[3] = (i + 1) * ny + j + 1;
+        stencil.weight[0] = (1 - fx) * (1 - fy);
+        stencil.weight[1] = fx * (1 - fy);
+        stencil.weight[2] = (1 - fx) * fy;
+        stencil.weight[3] = fx * fy;
+        return stencil;
+    }
+
+    inline float sample(std::vector<float> const& field, bilinear_stencil const& stencil) {
+        return stencil.weight[0] * field[stencil.index[0]] + stencil.weight[1] * field[stencil.index[1]] +
+               stencil.weight[2] * field[stencil.index[2]] + stencil.weight[3] * field[stencil.index[3]];
+    }
+
+    float dot_product(std::vector<float> const& a, std::vector<float> const& b) {
+        int const size = static_cast<int>(a.size());
+        double result = 0.0;
+
+        #pragma omp parallel for reduction(+:result)
+        for (int k = 0; k < size; ++k) {
+            result += a[k] * b[k];
+        }
+
+        return static_cast<float>(result);
+    }
+
+    float max_absolute(std::vector<float> const& a) {
+        float result = 0.0f;
+        for (float value : a) {
+            result = std::max(result, std::abs(value));
+        }
+        return result;
+    }
+}
+
+void FlipSolver::resize(float h, flip_parameters_structure const& flip_parameters) {
+    int const size = std::max(4, static_cast<int>(2.0f / (flip_parameters.cell_size * h)));
+    if (size == n) {
+        return;
+    }
+
+    n = size;
+    dx = 2.0f / static_cast<float>(n);
+    rest_cell_mass = 0.0f; // Measured again on the new cells
+
+    size_t const faces = static_cast<size_t>(n + 1) * n;
+    size_t const cells = static_cast<size_t>(n) * n;
+    for (auto field : {&u, &v, &u_weight, &v_weight, &u_saved, &v_saved, &u_correction, &v_correction}) {
+        field->assign(faces, 0.0f);
+    }
+    u_valid.assign(faces, 0);
+    v_valid.assign(faces, 0);
+    valid_next.assign(faces, 0);
+
+    fluid.assign(cells, 0);
+    for (auto field : {&cell_mass, &pressure, &residual, &auxiliary, &search, &preconditioner, &temporary}) {
+        field->assign(cells, 0.0f);
+    }
+}
+
+void FlipSolver::transfer_to_grid(Grid2d const& grid, sph_parameters_structure const& sph_parameters) {
+    PROFILE_SCOPE("particles to grid");
+
+    std::fill(u.begin(), u.end(), 0.0f);
+    std::fill(v.begin(), v.end(), 0.0f);
+    std::fill(u_weight.begin(), u_weight.end(), 0.0f);
+    std::fill(v_weight.begin(), v_weight.end(), 0.0f);
+    std::fill(fluid.begin(), fluid.end(), 0);
+    std::fill(cell_mass.begin(), cell_mass.end(), 0.0f);
+
+    // Mass weighted splatting, sequential as neighbouring particles write to the same faces
+    for (auto particle : grid.get_all_particles()) {
+        float const m = particle_mass(*particle, sph_parameters);
+
+        bilinear_stencil const su = get_stencil(particle->p, n + 1, n, 0.0f, 0.5f, dx);
+        bilinear_stencil const sv = get_stencil(particle->p, n, n + 1, 0.5f, 0.0f, dx);
+        for (int k = 0; k < 4; ++k) {
+            u[su.index[k]] += su.weight[k] * m * particle->v.x;
+            u_weight[su.index[k]] += su.weight[k] * m;
+            v[sv.index[k]] += sv.weight[k] * m * particle->v.y;
+            v_weight[sv.index[k]] += sv.weight[k] * m;
+        }
+
+        int const i = std::max(0, std::min(static_cast<int>((particle->p.x + 1.0f) / dx), n - 1));
+        int const j = std::max(0, std::min(static_cast<int>((particle->p.y + 1.0f) / dx), n - 1));
+        fluid[i * n + j] = 1;
+        cell_mass[i * n + j] += m;
+    }
+
+    for (size_t k = 0; k < u.size(); ++k) {
+        u_valid[k] = u_weight[k] > 0;
+        u[k] = u_valid[k] ? u[k] / u_weight[k] : 0.0f;
+        v_valid[k] = v_weight[k] > 0;
+        v[k] = v_valid[k] ? v[k] / v_weight[k] : 0.0f;
+    }
+
+    extrapolate(u, u_valid, n + 1, n);
+    extrapolate(v, v_valid, n, n + 1);
+}
+
+// Fill the faces without velocity with the mean of their valid neighbours, two layers deep
+void FlipSolver::extrapolate(std::vector<float>& field, std::vector<char>& valid, int nx, int ny) {
+    int const layers = 2;
+    for (int layer = 0; layer < layers; ++layer) {
+        valid_next = valid;
+
+        for (int i = 0; i < nx; ++i) {
+            for (int j = 0; j < ny; ++j) {
+                int const k = i * ny + j;
+                if (valid[k]) {
+                    continue;
+                }
+
+                float sum = 0.0f;
+                int count = 0;
+                if (i > 0 && valid[k - ny]) { sum += field[k - ny]; count++; }
+                if (i < nx - 1 && valid[k + ny]) { sum += field[k + ny]; count++; }
+                if (j > 0 && valid[k - 1]) { sum += field[k - 1]; count++; }
+                if (j < ny - 1 && valid[k + 1]) { sum += field[k + 1]; count++; }
+
+                if (count > 0) {
+                    field[k] = sum / static_cast<float>(count);
+                    valid_next[k] = 1;
+                }
+            }
+        }
+
+        valid.swap(valid_next);
+    }
+}
+
+void FlipSolver::apply_matrix(std::vector<float> const& x, std::vector<float>& result) const {
+    #pragma omp parallel for
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            int const c = i * n + j;
+            if (!fluid[c]) {
+                result[c] = 0.0f;
+                continue;
+            }
+
+            // Walls do not couple (Neumann), air cells have a zero pressure (Dirichlet)
+            float const diagonal = static_cast<float>((i > 0) + (i < n - 1) + (j > 0) + (j < n - 1));
+            float value = diagonal * x[c];
+            if (is_fluid(i - 1, j)) value -= x[c - n];
+            if (is_fluid(i + 1, j)) value -= x[c + n];
+            if (is_fluid(i, j - 1)) value -= x[c - 1];
+            if (is_fluid(i, j + 1)) value -= x[c + 1];
+            result[c] = value;
+        }
+    }
+}
+
+// Modified incomplete Cholesky factorization MIC(0), couplings between fluid cells are all -1
+void FlipSolver::compute_preconditioner() {
+    float const tuning = 0.97f;
+    float const safety = 0.25f;
+
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            int const c = i * n + j;
+            if (!fluid[c]) {
+                preconditioner[c] = 0.0f;
+                continue;
+            }
+
+            float const diagonal = static_cast<float>((i > 0) + (i < n - 1) + (j > 0) + (j < n - 1));
+            float const left = is_fluid(i - 1, j) ? preconditioner[c - n] : 0.0f;
+            float const below = is_fluid(i, j - 1) ? preconditioner[c - 1] : 0.0f;
+            float const left_up = is_fluid(i - 1, j) && is_fluid(i - 1, j + 1) ? 1.0f : 0.0f;
+            float const below_right = is_fluid(i, j - 1) && is_fluid(i + 1, j - 1) ? 1.0f : 0.0f;
+
+            float e = diagonal - left * left - below * below -
+                      tuning * (left_up * left * left + below_right * below * below);
+            if (e < safety * diagonal) {
+                e = diagonal;
+            }
+            preconditioner[c] = 1.0f / std::sqrt(e);
+        }
+    }
+}
+
+void FlipSolver::apply_preconditioner(std::vector<float> const& r, std::vector<float>& z) {
+    // Solve L q = r
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            int const c = i * n + j;
+            if (!fluid[c]) {
+                temporary[c] = 0.0f;
+                continue;
+            }
+
+            float t = r[c];
+            if (is_fluid(i - 1, j)) t += preconditioner[c - n] * temporary[c - n];
+            if (is_fluid(i, j - 1)) t += preconditioner[c - 1] * temporary[c - 1];
+            temporary[c] = t * preconditioner[c];
+        }
+    }
+
+    // Solve L^T z = q
+    for (int i = n - 1; i >= 0; --i) {
+        for (int j = n - 1; j >= 0; --j) {
+            int const c = i * n + j;
+            if (!fluid[c]) {
+                z[c] = 0.0f;
+                continue;
+            }
+
+            float t = temporary[c];
+            if (is_fluid(i + 1, j)) t += preconditioner[c] * z[c + n];
+            if (is_fluid(i, j + 1)) t += preconditioner[c] * z[c + 1];
+            z[c] = t * preconditioner[c];
+        }
+    }
+}
+
+// A fluid cell whose four sides are fluid cells or walls, away from the free surface
+bool FlipSolver::is_interior(int i, int j) const {
+    return is_fluid(i, j) && (i == 0 || is_fluid(i - 1, j)) && (i == n - 1 || is_fluid(i + 1, j)) &&
+           (j == 0 || is_fluid(i, j - 1)) && (j == n - 1 || is_fluid(i, j + 1));
+}
+
+// Preconditioned conjugate gradient on the fluid cells: pressure = A^-1 residual (residual is overwritten)
+int FlipSolver::solve_pressure(flip_parameters_structure const& flip_parameters, float& final_residual) {
+    std::fill(pressure.begin(), pressure.end(), 0.0f);
+    float const tolerance = flip_parameters.tolerance * max_absolute(residual);
+    int iterations = 0;
+    final_residual = max_absolute(residual);
+
+    if (final_residual > 0.0f) {
+        compute_preconditioner();
+        apply_preconditioner(residual, auxiliary);
+        search = auxiliary;
+        float sigma = dot_product(auxiliary, residual);
+
+        while (iterations < flip_parameters.max_iterations && final_residual > tolerance) {
+            apply_matrix(search, auxiliary);
+            float const alpha = sigma / dot_product(auxiliary, search);
+
+            int const cells = n * n;
+            #pragma omp parallel for
+            for (int c = 0; c < cells; ++c) {
+                pressure[c] += alpha * search[c];
+                residual[c] -= alpha * auxiliary[c];
+            }
+
+            iterations++;
+            final_residual = max_absolute(residual);
+            if (final_residual <= tolerance) {
+                break;
+            }
+
+            apply_preconditioner(residual, auxiliary);
+            float const sigma_new = dot_product(auxiliary, residual);
+            float const beta = sigma_new / sigma;
+
+            #pragma omp parallel for
+            for (int c = 0; c < cells; ++c) {
+                search[c] = auxiliary[c] + beta * search[c];
+            }
+            sigma = sigma_new;
+        }
+    }
+
+    return iterations;
+}
+
+// The unknown is pressure * dt / rho, so that the velocity update does not depend on dt
+void FlipSolver::project(flip_parameters_structure const& flip_parameters) {
+    PROFILE_SCOPE("pressure projection");
+
+    // Right hand side: minus the divergence of the fluid cells (scaled by dx^2)
+    flip_stats.fluid_cells = 0;
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            int const c = i * n + j;
+            float const divergence = u[(i + 1) * n + j] - u[i * n + j] + v[i * (n + 1) + j + 1] - v[i * (n + 1) + j];
+            residual[c] = fluid[c] ? -dx * divergence : 0.0f;
+            flip_stats.fluid_cells += fluid[c];
+        }
+    }
+
+    flip_stats.iterations = solve_pressure(flip_parameters, flip_stats.residual);
+
+    // Subtract the pressure gradient from the faces next to the fluid, the faces of the walls stay at 0
+    for (int i = 0; i <= n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            int const k = i * n + j;
+            bool const wall = i == 0 || i == n;
+            u_valid[k] = wall || is_fluid(i - 1, j) || is_fluid(i, j);
+            if (wall) {
+                u[k] = 0.0f;
+            } else if (u_valid[k]) {
+                u[k] -= (pressure[i * n + j] - pressure[(i - 1) * n + j]) / dx;
+            }
+        }
+    }
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j <= n; ++j) {
+            int const k = i * (n + 1) + j;
+            bool const wall = j == 0 || j == n;
+            v_valid[k] = wall || is_fluid(i, j - 1) || is_fluid(i, j);
+            if (wall) {
+                v[k] = 0.0f;
+            } else if (v_valid[k]) {
+                v[k] -= (pressure[i * n + j] - pressure[i * n + j - 1]) / dx;
+            }
+        }
+    }
+
+    extrapolate(u, u_valid, n + 1, n);
+    extrapolate(v, v_valid, n, n + 1);
+}
+
+void FlipSolver::compute_density_correction(float dt, flip_parameters_structure const& flip_parameters) {
+    PROFILE_SCOPE("density correction");
+
+    std::fill(u_correction.begin(), u_correction.end(), 0.0f);
+    std::fill(v_correction.begin(), v_correction.end(), 0.0f);
+    flip_stats.max_density_error = 0.0f;
+
+    // The rest mass of a cell is the mean mass of the interior cells of the first step
+    if (rest_cell_mass <= 0.0f) {
+        float mass = 0.0f;
+        int count = 0;
+        for (int i = 0; i < n; ++i) {
+            for (int j = 0; j < n; ++j) {
+                if (is_interior(i, j)) {
+                    mass += cell_mass[i * n + j];
+                    count++;
+                }
+            }
+        }
+        rest_cell_mass = count > 0 ? mass / static_cast<float>(count) : 0.0f;
+    }
+
+    if (flip_parameters.density_correction <= 0.0f || rest_cell_mass <= 0.0f) {
+        return;
+    }
+
+    // Right hand side: the divergence (scaled by dx^2) removing density_correction of the density error during dt
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            int const c = i * n + j;
+            residual[c] = 0.0f;
+            if (is_interior(i, j)) {
+                float const density_error = cell_mass[c] / rest_cell_mass - 1.0f;
+                residual[c] = flip_parameters.density_correction * density_error * dx * dx / dt;
+                flip_stats.max_density_error = std::max(flip_stats.max_density_error, std::abs(density_error));
+            }
+        }
+    }
+
+    float correction_residual = 0.0f;
+    solve_pressure(flip_parameters, correction_residual);
+
+    // Displacement velocity of the faces next to the fluid, the faces of the walls stay at 0
+    for (int i = 1; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            if (is_fluid(i - 1, j) || is_fluid(i, j)) {
+                u_correction[i * n + j] = -(pressure[i * n + j] - pressure[(i - 1) * n + j]) / dx;
+            }
+        }
+    }
+    for (int i = 0; i < n; ++i) {
+        for (int j = 1; j < n; ++j) {
+            if (is_fluid(i, j - 1) || is_fluid(i, j)) {
+                v_correction[i * (n + 1) + j] = -(pressure[i * n + j] - pressure[i * n + j - 1]) / dx;
+            }
+        }
+    }
+}
+
+float FlipSolver::step(float dt, Grid2d &grid, sph_parameters_structure const& sph_parameters,
+                       flip_parameters_structure const& flip_parameters) {
+    PROFILE_SCOPE("flip step");
+
+    float const gravity = 9.81f;
+
+    transfer_to_grid(grid, sph_parameters);
+    u_saved = u;
+    v_saved = v;
+
+    // Gravity, and no flow through the walls before measuring the divergence
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j <= n; ++j) {
+            v[i * (n + 1) + j] = j == 0 || j == n ? 0.0f : v[i * (n + 1) + j] - dt * gravity;
+        }
+    }
+    for (int j = 0; j < n; ++j) {
+        u[j] = 0.0f;
+        u[n * n + j] = 0.0f;
+    }
+
+    project(flip_parameters);
+    compute_density_correction(dt, flip_parameters);
+
+    std::vector<particle_element*> const& particles = grid.get_all_particles();
+    std::vector<int>& cell_ids = grid.get_cell_ids();
+    int const N = static_cast<int>(particles.size());
+    float const flip_ratio = flip_parameters.flip_ratio;
+    float const lower = -1.0f + 1e-3f * dx;
+    float const upper = 1.0f - 1e-3f * dx;
+
+    // Grid velocity plus the density correction, which moves the particles without changing their velocity
+    auto const advection_velocity = [&](vec3 const& p) {
+        bilinear_stencil const su = get_stencil(p, n + 1, n, 0.0f, 0.5f, dx);
+        bilinear_stencil const sv = get_stencil(p, n, n + 1, 0.5f, 0.0f, dx);
+        return vec3{sample(u, su) + sample(u_correction, su), sample(v, sv) + sample(v_correction, sv), 0};
+    };
+
+    float max_velocity = 0.0f;
+
+    #pragma omp parallel
+    {
+        PROFILE_SCOPE("grid to particles");
+
+        float local_max_velocity = 0.0f;
+
+        #pragma omp for
+        for (int i = 0; i < N; ++i) {
+            particle_element* particle = particles[i];
+            vec3& p = particle->p;
+
+            bilinear_stencil const su = get_stencil(p, n + 1, n, 0.0f, 0.5f, dx);
+            bilinear_stencil const sv = get_stencil(p, n, n + 1, 0.5f, 0.0f, dx);
+            vec3 const pic = {sample(u, su), sample(v, sv), 0};
+            vec3 const change = pic - vec3{sample(u_saved, su), sample(v_saved, sv), 0};
+
+            particle->v = flip_ratio * (particle->v + change) + (1.0f - flip_ratio) * pic;
+
+            // Density of the cell the particle comes from, kept for display and export
+            int const cx = std::max(0, std::min(static_cast<int>((p.x + 1.0f) / dx), n - 1));
+            int const cy = std::max(0, std::min(static_cast<int>((p.y + 1.0f) / dx), n - 1));
+            particle->rho = cell_mass[cx * n + cy] / (dx * dx);
+            particle->wake(); // The sleeping state belongs to the SPH solver
+
+            // Midpoint advection through the divergence free grid velocity
+            vec3 const middle = p + 0.5f * dt * advection_velocity(p);
+            p += dt * advection_velocity(middle);
+
+            // Walls: stay inside and drop the velocity going through them
+            if (p.x < lower) { p.x = lower; particle->v.x = std::max(0.0f, particle->v.x); }
+            if (p.x > upper) { p.x = upper; particle->v.x = std::min(0.0f, particle->v.x); }
+            if (p.y < lower) { p.y = lower; particle->v.y = std::max(0.0f, particle->v.y); }
+            if (p.y > upper) { p.y = upper; particle->v.y = std::min(0.0f, particle->v.y); }
+
+            cell_ids[i] = grid.get_cell_id(p);
+            local_max_velocity = std::max(local_max_velocity, norm(particle->v));
+        }
+
+        #pragma omp critical
+        {
+            max_velocity = std::max(max_velocity, local_max_velocity);
+        }
+    }
+
+    grid.update_particles_from_cell_ids();
+
+    return max_velocity;
+}
+
+void FlipSolver::simulate_frame(float frame_dt, Grid2d &grid, sph_parameters_structure const& sph_parameters,
+                                flip_parameters_structure const& flip_parameters, time_step_statistics &statistics) {
+    assert_cgp(!grid.is_periodic_x() && !grid.is_periodic_y(), "The FLIP/PIC solver does not support periodic boundaries");
+    resize(sph_parameters.h, flip_parameters);
+
+    statistics.steps = 0;
+    std::fill(std::begin(statistics.level_histogram), std::end(statistics.level_histogram), 0ul);
+    statistics.level_histogram[0] = grid.get_number_of_particles();
+
+    // Only the grid CFL bounds the step, the number of steps is fixed once per frame (summing the steps in float could
+    // add a tiny extra one at the end) and the frame is split in equal steps
+    int number_of_steps = 1;
+    if (statistics.max_velocity > 0.0f) {
+        float const stable_dt = flip_parameters.cfl * dx / statistics.max_velocity;
+        number_of_steps = static_cast<int>(std::ceil(frame_dt / std::min(frame_dt, stable_dt)));
+    }
+
+    float const dt = frame_dt / static_cast<float>(number_of_steps);
+    for (int step_index = 0; step_index < number_of_steps; ++step_index) {
+        statistics.max_velocity = step(dt, grid, sph_parameters, flip_parameters);
+        statistics.dt = dt;
+        statistics.steps++;
+    }
+}
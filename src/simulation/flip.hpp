@@ -0,0 +1,95 @@
+#pragma once
+
+#include "simulation.hpp"
+
+#include <vector>
+
+struct flip_parameters_structure {
+    float flip_ratio = 0.95f; // Blend of the grid velocity change (FLIP, 1) and of the grid velocity itself (PIC, 0)
+
+    float cell_size = 2.0f; // Width of the MAC cells in units of h (about 4 particles per cell at rest density)
+
+    float cfl = 1.0f; // Number of cells the fastest particle may cross during one step
+
+    int max_iterations = 200; // Bound on the conjugate gradient iterations of the pressure solve
+
+    float tolerance = 1e-5f; // Residual of the pressure solve, relative to the largest divergence
+
+    float density_correction = 0.5f; // Fraction of the density error of the cells removed at each step (0 disables it)
+};
+
+struct flip_statistics {
+    int iterations = 0; // Conjugate gradient iterations of the last pressure solve
+
+    float residual = 0.0f; // Largest residual left by the last pressure solve
+
+    int fluid_cells = 0; // Number of cells holding particles during the last step
+
+    float max_density_error = 0.0f; // Largest |cell mass / rest cell mass - 1| of the interior cells during the last step
+};
+
+/**
+ * @brief Hybrid FLIP/PIC solver on a staggered MAC grid covering the domain of Grid2d
+ *
+ * The particles stay stored in the Grid2d, only their velocities go through the MAC grid: they are splatted on the
+ * faces (bilinear weights), gravity is added and the pressure projection makes the face velocities divergence free.
+ * The Poisson equation is solved with a conjugate gradient preconditioned by the modified incomplete Cholesky
+ * factorization MIC(0). The particles then get back flip_ratio * (v + grid change) + (1 - flip_ratio) * grid velocity
+ * and are advected through the grid velocity (midpoint rule).
+ *
+ * A divergence free velocity keeps the number of fluid cells but not the number of particles per cell: cells next to
+ * the walls would stay half empty and others over-full, so that the fluid slowly gains volume. The advection thus
+ * also moves them along a second field, whose divergence is proportional to the density error of each cell (measured
+ * against the mass of a full interior cell at the first step): over-full cells are pushed apart and under-full cells
+ * (away from the free surface, whose cells are partly empty by nature) are filled. This field only moves the
+ * particles, it does not add to their velocity.
+ *
+ * The four sides of the domain are walls, periodic boundaries are not supported (the grid must not be periodic). The
+ * time step is only bounded by the CFL on the grid, which allows much larger steps than the SPH solver
+ */
+class FlipSolver {
+public:
+    /**
+     * @brief Advance the simulation by frame_dt
+     *
+     * @param statistics The step size and number of steps are reported as for simulate_frame
+     */
+    void simulate_frame(float frame_dt, Grid2d &grid, sph_parameters_structure const& sph_parameters,
+                        flip_parameters_structure const& flip_parameters, time_step_statistics &statistics);
+
+    flip_statistics const& get_statistics() const { return flip_stats; }
+
+private:
+    int n = 0;        // Number of cells along each axis
+    float dx = 0.0f;  // Width of a cell
+
+    std::vector<float> u, v;             // Face velocities: u is (n + 1) x n, v is n x (n + 1)
+    std::vector<float> u_weight, v_weight;
+    std::vector<float> u_saved, v_saved; // Face velocities before the forces and projection (FLIP update)
+    std::vector<float> u_correction, v_correction; // Face displacement velocities of the density correction
+    std::vector<char> u_valid, v_valid, valid_next; // Faces holding a velocity (others are extrapolated)
+
+    std::vector<char> fluid;         // Cells holding at least one particle
+    std::vector<float> cell_mass;    // Mass of the particles of each cell
+    float rest_cell_mass = 0.0f;     // Mass of a full interior cell, measured at the first step
+    std::vector<float> pressure;     // Pressure times dt / rho of each cell, 0 in the air
+    std::vector<float> residual, auxiliary, search, preconditioner, temporary; // Conjugate gradient storage
+
+    flip_statistics flip_stats;
+
+    void resize(float h, flip_parameters_structure const& flip_parameters);
+    void transfer_to_grid(Grid2d const& grid, sph_parameters_structure const& sph_parameters);
+    void project(flip_parameters_structure const& flip_parameters);
+    void compute_density_correction(float dt, flip_parameters_structure const& flip_parameters);
+    int solve_pressure(flip_parameters_structure const& flip_parameters, float& final_residual);
+    bool is_interior(int i, int j) const;
+    void extrapolate(std::vector<float>& field, std::vector<char>& valid, int nx, int ny);
+    float step(float dt, Grid2d &grid, sph_parameters_structure const& sph_parameters,
+               flip_parameters_structure const& flip_parameters);
+
+    // Pressure matrix (5 points Laplacian with walls and free surface) and its preconditioner
+    void apply_matrix(std::vector<float> const& x, std::vector<float>& result) const;
+    void compute_preconditioner();
+    void apply_preconditioner(std::vector<float> const& r, std::vector<float>& z);
+    inline bool is_fluid(int i, int j) const { return i >= 0 && j >= 0 && i < n && j < n && fluid[i * n + j]; }
+};
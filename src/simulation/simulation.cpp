@@ -1,5 +1,11 @@
 #include "simulation.hpp"
 #include "grid2D.hpp"
+#include "profiling/profiler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <limits>
 
 using namespace cgp;
 
@@ -19,22 +25,92 @@ vec3 W_gradient_pressure(vec3 const& p_i, vec3 const& p_j, float h)
     return -45.0f / (Pi*std::pow(h,6)) * std::pow(h-norm(p_i-p_j),2) * (p_i - p_j) / norm(p_i - p_j);
 }
 
-float W_density(vec3 const& p_i, const vec3& p_j, float h)
+float W_density(vec3 const& p_i, vec3 const& p_j, float h)
 {
     float const r = norm(p_i-p_j);
     assert_cgp_no_msg(r<=h);
     return 315.0/(64.0*3.14159f*std::pow(h,9)) * std::pow(h*h-r*r, 3.0f);
 }
 
+// A particle of level l starts a new step every 2^(finest_level - l) substeps of the block
+bool is_due(particle_element const& particle, int substep, int finest_level) {
+    int const level = std::min(particle.level, finest_level);
+    return substep % (1 << (finest_level - level)) == 0;
+}
+
 void update_density(Grid2d &grid, sph_parameters_structure const& sph_parameters) {
     float const h = sph_parameters.h;
+
+    std::vector<particle_element*> const& particles = grid.get_all_particles();
+    int const N = static_cast<int>(particles.size());
+
+    #pragma omp parallel
+    {
+        PROFILE_SCOPE("density");
+
+        #pragma omp for schedule(dynamic, 64)
+        for (int i = 0; i < N; ++i) {
+            particle_element *particle = particles[i];
+            if (particle->sleeping) {
+                continue; // Density stays frozen while asleep
+            }
+
+            if (!particle->density_needed) {
+                continue; // Not read by any force computed at this sub-step
+            }
+
+            particle->rho = 0.0f;
+
+            // The query radius h covers the largest particles, each pair uses the mean of both smoothing lengths
+            grid.for_each_particle_in_radius(particle->p, h, [&](particle_element* neighbour) {
+                // Closest image of the neighbour across the periodic edges
+                vec3 const p_j = particle->p - grid.minimum_image(particle->p - neighbour->p);
+
+                float const h_ij = 0.5f * (particle_h(*particle, sph_parameters) + particle_h(*neighbour, sph_parameters));
+                if (norm(particle->p - p_j) >= h_ij) {
+                    return;
+                }
+
+                particle->rho += particle_mass(*neighbour, sph_parameters) * planar_kernel_factor(h_ij, sph_parameters) *
+                                 W_density(particle->p, p_j, h_ij);
+            });
+        }
+    }
+}
+
+// Same as update_density, the neighbours being read from the compact storage of the grid
+void update_density_compact(Grid2d &grid, sph_parameters_structure const& sph_parameters) {
+    float const h = sph_parameters.h;
     float const m = sph_parameters.m;
 
-    for (auto particle: grid.get_all_particles()) {
-        particle->rho = 0.0f;
+    std::vector<particle_element*> const& particles = grid.get_all_particles();
+    int const N = static_cast<int>(particles.size());
+
+    #pragma omp parallel
+    {
+        PROFILE_SCOPE("density");
 
-        for (auto neighbour: grid.get_particles_influencing(*particle)) {
-            particle->rho += m * W_density(particle->p, neighbour->p, h);
+        #pragma omp for schedule(dynamic, 64)
+        for (int i = 0; i < N; ++i) {
+            particle_element *particle = particles[i];
+            if (particle->sleeping || !particle->density_needed) {
+                continue;
+            }
+
+            float const h_i = particle_h(*particle, sph_parameters);
+            float rho = 0.0f;
+
+            grid.for_each_compact_particle_in_radius(particle->p, h, [&](int slot, vec3 const& p_j) {
+                float const scale_j = grid.get_compact_scale(slot);
+                float const h_ij = 0.5f * (h_i + scale_j * h);
+                if (norm(particle->p - p_j) >= h_ij) {
+                    return;
+                }
+
+                rho += scale_j * scale_j * m * planar_kernel_factor(h_ij, sph_parameters) * W_density(particle->p, p_j, h_ij);
+            });
+
+            particle->rho = rho;
         }
     }
 }
@@ -44,78 +120,471 @@ void update_pressure(Grid2d &grid, sph_parameters_structure const& sph_parameter
     float const stiffness = sph_parameters.stiffness;
 
     for (auto particle: grid.get_all_particles()) {
+        if (particle->sleeping || !particle->density_needed) {
+            continue;
+        }
+
         particle->pressure = density_to_pressure(particle->rho, rho0, stiffness);
     }
 }
 
-void update_force(Grid2d &grid, sph_parameters_structure const& sph_parameters) {
+void update_force(Grid2d &grid, sph_parameters_structure const& sph_parameters, int substep, int finest_level) {
     float const gravity = 9.81f;
-    float const m = sph_parameters.m;
     float const h = sph_parameters.h;
     float const nu = sph_parameters.nu;
 
-    // Apply gravity to the force
-    for (auto particle: grid.get_all_particles()) {
-        particle->f = sph_parameters.m * vec3{0, -gravity, 0};
+    std::vector<particle_element*> const& particles = grid.get_all_particles();
+    int const N = static_cast<int>(particles.size());
+
+    #pragma omp parallel
+    {
+        PROFILE_SCOPE("force");
+
+        #pragma omp for schedule(dynamic, 64)
+        for (int i = 0; i < N; ++i) {
+            particle_element *particle = particles[i];
+            if (particle->sleeping) {
+                continue; // Force stays frozen while asleep
+            }
+
+            if (!is_due(*particle, substep, finest_level)) {
+                continue; // Slow particles keep the force of the beginning of their step
+            }
+
+            float const m_i = particle_mass(*particle, sph_parameters);
+
+            // Apply gravity to the force
+            particle->f = m_i * vec3{0, -gravity, 0};
+
+            // Apply pressure and viscosity to the force
+            vec3 viscosity_force = vec3{0, 0, 0};
+            vec3 pressure_force = vec3{0, 0, 0};
+
+            grid.for_each_particle_in_radius(particle->p, h, [&](particle_element* neighbour) {
+                vec3 const p_j = particle->p - grid.minimum_image(particle->p - neighbour->p);
+
+                float const h_ij = 0.5f * (particle_h(*particle, sph_parameters) + particle_h(*neighbour, sph_parameters));
+                if (neighbour == particle || norm(particle->p - p_j) >= h_ij) {
+                    return;
+                }
+
+                float const m_j = particle_mass(*neighbour, sph_parameters);
+                float const planar = planar_kernel_factor(h_ij, sph_parameters);
+
+                pressure_force += m_j * (particle->pressure + neighbour->pressure) / (2.0f * neighbour->rho) *
+                                  planar * W_gradient_pressure(particle->p, p_j, h_ij);
+
+                viscosity_force += m_j * (neighbour->v - particle->v) / neighbour->rho *
+                                   planar * W_laplacian_viscosity(particle->p, p_j, h_ij);
+            });
+
+            particle->f += -m_i / particle->rho * pressure_force + m_i * nu * viscosity_force;
+        }
     }
+}
 
-    // Apply viscosity to the force
-    for (auto particle: grid.get_all_particles()) {
-        vec3 viscosity_force = vec3{0, 0, 0};
-        vec3 pressure_force = vec3{0, 0, 0};
+// Same as update_force, the neighbours being read from the compact storage of the grid
+void update_force_compact(Grid2d &grid, sph_parameters_structure const& sph_parameters, int substep, int finest_level) {
+    float const gravity = 9.81f;
+    float const h = sph_parameters.h;
+    float const m = sph_parameters.m;
+    float const nu = sph_parameters.nu;
+
+    std::vector<particle_element*> const& particles = grid.get_all_particles();
+    int const N = static_cast<int>(particles.size());
+
+    #pragma omp parallel
+    {
+        PROFILE_SCOPE("force");
 
-        for (auto neighbour: grid.get_particles_influencing(*particle)) {
-            if (neighbour == particle) {
+        #pragma omp for schedule(dynamic, 64)
+        for (int i = 0; i < N; ++i) {
+            particle_element *particle = particles[i];
+            if (particle->sleeping || !is_due(*particle, substep, finest_level)) {
                 continue;
             }
 
-            pressure_force += m * (particle->pressure + neighbour->pressure) / (2.0f * neighbour->rho) *
-                              W_gradient_pressure(particle->p, neighbour->p, h);
+            int const own_slot = grid.get_compact_slot(i);
+            float const h_i = particle_h(*particle, sph_parameters);
+            float const m_i = particle_mass(*particle, sph_parameters);
+            vec3 const v_i = grid.get_compact_velocity(own_slot); // Same rounding as the neighbours
 
-            viscosity_force += m * (neighbour->v - particle->v) / neighbour->rho *
-                               W_laplacian_viscosity(particle->p, neighbour->p, h);
-        }
+            vec3 viscosity_force = vec3{0, 0, 0};
+            vec3 pressure_force = vec3{0, 0, 0};
+
+            grid.for_each_compact_particle_in_radius(particle->p, h, [&](int slot, vec3 const& p_j) {
+                float const scale_j = grid.get_compact_scale(slot);
+                float const h_ij = 0.5f * (h_i + scale_j * h);
+                if (slot == own_slot || norm(particle->p - p_j) >= h_ij) {
+                    return;
+                }
 
-        particle->f += -m / particle->rho * pressure_force + m * nu * viscosity_force;
+                float const m_j = scale_j * scale_j * m;
+                float const planar = planar_kernel_factor(h_ij, sph_parameters);
+                float const rho_j = grid.get_compact_rho(slot);
+
+                pressure_force += m_j * (particle->pressure + grid.get_compact_pressure(slot)) / (2.0f * rho_j) *
+                                  planar * W_gradient_pressure(particle->p, p_j, h_ij);
+
+                viscosity_force += m_j * (grid.get_compact_velocity(slot) - v_i) / rho_j *
+                                   planar * W_laplacian_viscosity(particle->p, p_j, h_ij);
+            });
+
+            particle->f = m_i * vec3{0, -gravity, 0} - m_i / particle->rho * pressure_force + m_i * nu * viscosity_force;
+        }
     }
 }
 
-void simulate(float dt, Grid2d &grid, sph_parameters_structure const& sph_parameters) {
-    update_density(grid, sph_parameters);
-    update_pressure(grid, sph_parameters);
-    update_force(grid, sph_parameters);
+void update_activity(Grid2d &grid, sph_parameters_structure const& sph_parameters) {
+    float const sleep_velocity = sph_parameters.sleep_velocity;
 
-    float const damping = 0.005f;
-    float const m = sph_parameters.m;
+    if (!sph_parameters.sleeping) {
+        for (auto particle: grid.get_all_particles()) {
+            particle->wake();
+        }
+        return;
+    }
+
+    // A moving particle disturbs its whole neighbourhood: sleeping neighbours wake up and calm ones start counting again
+    for (auto particle: grid.get_all_particles()) {
+        if (particle->sleeping || norm(particle->v) < sleep_velocity) {
+            continue;
+        }
+
+        grid.for_each_particle_in_radius(particle->p, sph_parameters.h, [](particle_element* neighbour) {
+            neighbour->wake();
+        });
+    }
+
+    // Particles that stayed calm long enough, at a steady density, fall asleep
     for (auto particle: grid.get_all_particles()) {
-        vec3& p = particle->p;
-        vec3& v = particle->v;
-        vec3& f = particle->f;
+        if (particle->sleeping) {
+            continue;
+        }
+
+        // A particle is calm when it is slow and its density did not drift since its calm steps started
+        bool const steady = particle->calm_steps == 0 ||
+                            std::abs(particle->rho - particle->calm_density) <
+                            sph_parameters.sleep_density_change * particle->calm_density;
+        if (norm(particle->v) < sleep_velocity && steady) {
+            if (particle->calm_steps == 0) {
+                particle->calm_density = particle->rho;
+            }
+            particle->calm_steps++;
+        } else {
+            particle->calm_steps = 0;
+        }
+
+        if (particle->calm_steps < sph_parameters.sleep_steps) {
+            continue;
+        }
+
+        // Every neighbour must be calm or asleep too, otherwise the particle would freeze next to a moving one
+        bool calm_neighbourhood = true;
+        grid.for_each_particle_in_radius(particle->p, sph_parameters.h, [&](particle_element* neighbour) {
+            calm_neighbourhood &= neighbour->sleeping || neighbour->calm_steps > 0;
+        });
+
+        if (calm_neighbourhood) {
+            particle->sleeping = true;
+            particle->v = vec3{0, 0, 0};
+        }
+    }
+}
+
+// Largest time step allowed by the CFL and force criteria for the given velocity and acceleration
+float stable_time_step(float velocity, float acceleration, float h, sph_parameters_structure const& sph_parameters,
+                       time_step_parameters_structure const& time_step_parameters) {
+    float dt = std::numeric_limits<float>::max();
 
-        v = (1 - damping) * v + dt * f / m;
-        p += dt * v;
+    // Pressure waves travel at the speed of sound of the equation of state (c^2 = dp/drho = stiffness)
+    float const sound_speed = std::sqrt(sph_parameters.stiffness);
+    if (velocity + sound_speed > 0) {
+        dt = std::min(dt, time_step_parameters.cfl * h / (velocity + sound_speed));
+    }
+    if (acceleration > 0) {
+        dt = std::min(dt, time_step_parameters.force_factor * std::sqrt(h / acceleration));
     }
 
-    // Collision
+    return dt;
+}
+
+// Fused kernel: integration, wall collisions and new cell id of every particle in a single sweep
+void integrate_and_collide(float dt_base, int substep, int finest_level, Grid2d &grid,
+                           sph_parameters_structure const& sph_parameters, time_step_statistics &statistics) {
+    float const damping = 1.0f; // Velocity damping rate in 1/s (0.5% per step of 0.005 s, the original fixed step)
     float const epsilon = 1e-3f;
+    float const dt_fine = dt_base / static_cast<float>(1 << finest_level);
+
+    // Periodic axes have no walls, the positions wrap around instead
+    float const periodic_x = static_cast<float>(grid.is_periodic_x());
+    float const periodic_y = static_cast<float>(grid.is_periodic_y());
+
+    std::vector<particle_element*> const& particles = grid.get_all_particles();
+    std::vector<int>& cell_ids = grid.get_cell_ids();
+    int const N = static_cast<int>(particles.size());
+
+    float max_velocity = 0.0f;
+    float max_acceleration = 0.0f;
+    float min_scale = 1.0f;
+
+    // Max-reduction of the velocity and acceleration, used to choose the next time step
+    #pragma omp parallel
+    {
+        PROFILE_SCOPE("integration");
+
+        float local_max_velocity = 0.0f;
+        float local_max_acceleration = 0.0f;
+        float local_min_scale = 1.0f;
+
+        #pragma omp for
+        for (int i = 0; i < N; ++i) {
+            particle_element *particle = particles[i];
+
+            vec3& p = particle->p;
+            vec3& v = particle->v;
+            vec3 const& f = particle->f;
+            float const m = particle_mass(*particle, sph_parameters);
+
+            // Sleeping particles are left untouched, slow particles are only kicked at the beginning of their own step
+            float const awake = static_cast<float>(!particle->sleeping);
+            float const kick = awake * static_cast<float>(is_due(*particle, substep, finest_level));
+            float const dt = dt_base / static_cast<float>(1 << std::min(particle->level, finest_level));
+
+            v += kick * dt * (f / m - damping * v);
+            p += awake * dt_fine * v;
+
+            p.x -= periodic_x * 2.0f * std::floor(0.5f * (p.x + 1.0f));
+            p.y -= periodic_y * 2.0f * std::floor(0.5f * (p.y + 1.0f));
+
+            // Walls (bottom, left, right): clamp the position slightly inside and bounce the velocity.
+            // The per-particle offset keeps particles from piling up exactly on the wall. It comes from an integer
+            // (Fibonacci) hash of the index, exact for any number of particles, scaled to [0, 1) from its top 24 bits
+            float const offset = epsilon * static_cast<float>((static_cast<uint32_t>(i) * 2654435769u) >> 8) *
+                                 (1.0f / 16777216.0f);
+            float const hit_bottom = (1.0f - periodic_y) * static_cast<float>(p.y < -1);
+            float const hit_left = (1.0f - periodic_x) * static_cast<float>(p.x < -1);
+            float const hit_right = (1.0f - periodic_x) * static_cast<float>(p.x > 1);
+
+            p.y = p.y + hit_bottom * (-1 + offset - p.y);
+            p.x = std::min(std::max(p.x, -1 + hit_left * offset), 1 - hit_right * offset);
+            v.y *= 1.0f - 1.5f * hit_bottom;
+            v.x *= 1.0f - 1.5f * (hit_left + hit_right);
+
+            cell_ids[i] = grid.get_cell_id(p);
+
+            local_max_velocity = std::max(local_max_velocity, awake * norm(v));
+            local_max_acceleration = std::max(local_max_acceleration, kick * norm(f) / m);
+            local_min_scale = std::min(local_min_scale, particle->scale);
+        }
+
+        #pragma omp critical
+        {
+            max_velocity = std::max(max_velocity, local_max_velocity);
+            max_acceleration = std::max(max_acceleration, local_max_acceleration);
+            min_scale = std::min(min_scale, local_min_scale);
+        }
+    }
+
+    statistics.max_velocity = max_velocity;
+    statistics.max_acceleration = max_acceleration;
+    statistics.min_scale = min_scale;
+}
+
+// Flag the particles whose density is read at this sub-step: the due ones and their neighbours. Every particle is due
+// at the first sub-step of a block, the neighbourhoods only need to be walked for the following ones
+void mark_density_needed(Grid2d &grid, sph_parameters_structure const& sph_parameters, int substep, int finest_level) {
+    std::vector<particle_element*> const& particles = grid.get_all_particles();
+
+    bool const all_due = substep == 0;
+    for (auto particle: particles) {
+        particle->density_needed = all_due;
+    }
+
+    if (all_due) {
+        return;
+    }
+
+    float const h = sph_parameters.h;
+    for (auto particle: particles) {
+        if (particle->sleeping || !is_due(*particle, substep, finest_level)) {
+            continue;
+        }
+
+        particle->density_needed = true;
+        grid.for_each_particle_in_radius(particle->p, h, [](particle_element* neighbour) {
+            neighbour->density_needed = true;
+        });
+    }
+}
+
+void simulate_substep(float dt_base, int substep, int finest_level, Grid2d &grid,
+                      sph_parameters_structure const& sph_parameters, time_step_statistics &statistics) {
+    PROFILE_SCOPE("step");
+
+    mark_density_needed(grid, sph_parameters, substep, finest_level);
+
+    if (grid.has_compact_storage()) {
+        grid.update_compact_storage();
+        update_density_compact(grid, sph_parameters);
+        update_pressure(grid, sph_parameters);
+        grid.update_compact_fields();
+        update_force_compact(grid, sph_parameters, substep, finest_level);
+    } else {
+        update_density(grid, sph_parameters);
+        update_pressure(grid, sph_parameters);
+        update_force(grid, sph_parameters, substep, finest_level);
+    }
+
+    integrate_and_collide(dt_base, substep, finest_level, grid, sph_parameters, statistics);
+
+    grid.update_particles_from_cell_ids(); // Update the grid with the cells computed by the integration
+}
+
+// Bin every active particle into the coarsest level whose step satisfies its own CFL and force criteria
+int assign_time_step_levels(float dt_base, Grid2d &grid, sph_parameters_structure const& sph_parameters,
+                            time_step_parameters_structure const& time_step_parameters,
+                            time_step_statistics &statistics) {
+    int finest_level = 0;
     for (auto particle: grid.get_all_particles()) {
-        vec3& p = particle->p;
-        vec3& v = particle->v;
+        if (particle->sleeping) {
+            continue;
+        }
+
+        float const dt_particle = stable_time_step(norm(particle->v), norm(particle->f) / particle_mass(*particle, sph_parameters),
+                                                   particle_h(*particle, sph_parameters), sph_parameters, time_step_parameters);
+
+        int level = 0;
+        while (level < time_step_parameters.max_level && dt_base / static_cast<float>(1 << level) > dt_particle) {
+            level++;
+        }
+
+        particle->level = level;
+        statistics.level_histogram[level]++;
+        finest_level = std::max(finest_level, level);
+    }
 
-        if (p.y < -1) { // Bottom
-            p.y = -1 + epsilon * rand_interval();
-            v.y *= -0.5f;
+    return finest_level;
+}
+
+void simulate_frame(float frame_dt, Grid2d &grid, sph_parameters_structure const& sph_parameters,
+                    time_step_parameters_structure const& time_step_parameters, time_step_statistics &statistics) {
+    statistics.steps = 0;
+    std::fill(std::begin(statistics.level_histogram), std::end(statistics.level_histogram), 0ul);
+
+    // The number of steps is fixed once per frame, summing the steps in float could add a tiny extra one at the end
+    int number_of_steps = 1;
+    if (time_step_parameters.adaptive) {
+        // The smallest particles bound the step (conservative when the fastest ones are larger)
+        float dt = stable_time_step(statistics.max_velocity, statistics.max_acceleration,
+                                    statistics.min_scale * sph_parameters.h, sph_parameters, time_step_parameters);
+
+        // Only the fastest particles need the finest level, the base step can be 2^max_level times larger
+        if (time_step_parameters.multi_rate) {
+            dt *= static_cast<float>(1 << time_step_parameters.max_level);
+        }
+
+        dt = std::min(frame_dt, std::max(time_step_parameters.dt_min, dt));
+        number_of_steps = static_cast<int>(std::ceil(frame_dt / dt));
+    }
+
+    // Split the frame in equal steps rather than ending with a tiny one
+    float const dt = frame_dt / static_cast<float>(number_of_steps);
+    for (int step = 0; step < number_of_steps; ++step) {
+        int finest_level = 0;
+        if (time_step_parameters.adaptive && time_step_parameters.multi_rate) {
+            std::fill(std::begin(statistics.level_histogram), std::end(statistics.level_histogram), 0ul);
+            finest_level = assign_time_step_levels(dt, grid, sph_parameters, time_step_parameters, statistics);
+        } else {
+            statistics.level_histogram[0] = grid.get_number_of_particles() - grid.get_number_of_sleeping_particles();
         }
 
-        if (p.x < -1) { // Left
-            p.x = -1 + epsilon * rand_interval();
-            v.x *= -0.5f;
+        int const number_of_substeps = 1 << finest_level;
+        for (int substep = 0; substep < number_of_substeps; ++substep) {
+            simulate_substep(dt, substep, finest_level, grid, sph_parameters, statistics);
         }
+        mark_density_needed(grid, sph_parameters, 0, 0); // Outside of the sub-steps, every density may be read again
+
+        update_activity(grid, sph_parameters);
+
+        statistics.dt = dt;
+        statistics.steps += number_of_substeps;
+    }
+}
+
+compact_storage_report measure_compact_storage(Grid2d &grid, sph_parameters_structure const& sph_parameters) {
+    std::vector<particle_element*> const& particles = grid.get_all_particles();
+    size_t const N = particles.size();
+    bool const compact_storage = grid.has_compact_storage();
+    bool const compact_velocity = grid.has_compact_velocity();
+
+    // Keep the state of the simulation, both passes overwrite it
+    std::vector<float> saved_rho(N), saved_pressure(N);
+    std::vector<vec3> saved_force(N);
+    for (size_t k = 0; k < N; ++k) {
+        saved_rho[k] = particles[k]->rho;
+        saved_pressure[k] = particles[k]->pressure;
+        saved_force[k] = particles[k]->f;
+    }
+
+    // Reference: full float storage
+    grid.set_compact_storage(false, false);
+    auto const full_start = std::chrono::steady_clock::now();
+    update_density(grid, sph_parameters);
+    update_pressure(grid, sph_parameters);
+    update_force(grid, sph_parameters, 0, 0);
+    auto const full_end = std::chrono::steady_clock::now();
+
+    std::vector<float> full_rho(N);
+    std::vector<vec3> full_force(N);
+    for (size_t k = 0; k < N; ++k) {
+        full_rho[k] = particles[k]->rho;
+        full_force[k] = particles[k]->f;
+        particles[k]->rho = saved_rho[k];
+        particles[k]->pressure = saved_pressure[k];
+    }
 
-        if (p.x > 1) { // Right
-            p.x = 1 - epsilon * rand_interval();
-            v.x *= -0.5f;
+    // Compact storage, with the quantization of the velocities currently chosen
+    grid.set_compact_storage(true, compact_velocity);
+    auto const compact_start = std::chrono::steady_clock::now();
+    grid.update_compact_storage();
+    update_density_compact(grid, sph_parameters);
+    update_pressure(grid, sph_parameters);
+    grid.update_compact_fields();
+    update_force_compact(grid, sph_parameters, 0, 0);
+    auto const compact_end = std::chrono::steady_clock::now();
+
+    compact_storage_report report;
+    report.full_milliseconds = std::chrono::duration<double, std::milli>(full_end - full_start).count();
+    report.compact_milliseconds = std::chrono::duration<double, std::milli>(compact_end - compact_start).count();
+
+    size_t measured = 0;
+    for (size_t k = 0; k < N; ++k) {
+        particle_element* particle = particles[k];
+        if (!particle->sleeping) {
+            float const density_error = std::abs(particle->rho - full_rho[k]) / full_rho[k];
+            // At rest the pressure balances gravity and the total force vanishes, compare to the weight at least
+            float const weight = 9.81f * particle_mass(*particle, sph_parameters);
+            float const force_error = norm(particle->f - full_force[k]) / std::max(norm(full_force[k]), weight);
+
+            report.max_density_error = std::max(report.max_density_error, density_error);
+            report.mean_density_error += density_error;
+            report.max_force_error = std::max(report.max_force_error, force_error);
+            report.mean_force_error += force_error;
+            measured++;
         }
+
+        particle->rho = saved_rho[k];
+        particle->pressure = saved_pressure[k];
+        particle->f = saved_force[k];
     }
-    grid.update_particles(); // Update the grid with the new particle positions
-}
\ No newline at end of file
+
+    if (measured > 0) {
+        report.mean_density_error /= static_cast<float>(measured);
+        report.mean_force_error /= static_cast<float>(measured);
+    }
+
+    grid.set_compact_storage(compact_storage, compact_velocity);
+
+    return report;
+}
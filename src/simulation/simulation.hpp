@@ -12,8 +12,23 @@ struct particle_element {
     float rho;      // density at this particle position
     float pressure; // pressure at this particle position
 
-    particle_element() : p{0,0,0},v{0,0,0},f{0,0,0},rho(0),pressure(0) {}
+    bool sleeping;  // a sleeping particle keeps its density and force frozen and does not move
+    int calm_steps; // number of consecutive steps the particle stayed below the sleep velocity threshold
+    float calm_density; // density of the particle when its calm steps started
+
+    int level; // sub-step level of the particle when using multi-rate time stepping (step is dt / 2^level)
+    bool density_needed; // the density of the particle is read at the current sub-step (it is due or has a due neighbour)
+
+    float scale; // resolution of the particle: its smoothing length is scale * h and its mass scale^2 * m
+
+    particle_element() : p{0,0,0},v{0,0,0},f{0,0,0},rho(0),pressure(0),sleeping(false),calm_steps(0),calm_density(0),level(0),density_needed(true),scale(1) {}
     particle_element(particle_element const &p) = default;
+
+    // Put the particle back in the active set
+    void wake() {
+        sleeping = false;
+        calm_steps = 0;
+    }
 };
 
 struct sph_parameters_structure {
@@ -26,6 +41,110 @@ struct sph_parameters_structure {
     float nu = 0.02f; // viscosity parameter
 
     float stiffness = 8.0f; // Stiffness converting density to pressure
+
+    bool sleeping = true; // Allow settled particles to fall asleep
+
+    float sleep_velocity = 0.05f; // Speed under which a particle is considered calm
+
+    float sleep_density_change = 0.01f; // Relative density change over the calm steps under which a particle may sleep
+
+    int sleep_steps = 30; // Number of consecutive calm steps before a particle falls asleep
+};
+
+// Smoothing length of a particle
+inline float particle_h(particle_element const& particle, sph_parameters_structure const& sph_parameters) {
+    return particle.scale * sph_parameters.h;
+}
+
+// Mass of a particle (the mass scales with the area covered by the particle)
+inline float particle_mass(particle_element const& particle, sph_parameters_structure const& sph_parameters) {
+    return particle.scale * particle.scale * sph_parameters.m;
+}
+
+// The kernels below are normalized in 3D while the particles live in a plane, so that the density of a layer of
+// particles scales as m / h. This factor gives the kernels of a pair the 2D scaling in h_ij instead (the density then
+// only depends on the mass per area, which a split or merge preserves), and is 1 for two unrefined particles
+inline float planar_kernel_factor(float h_ij, sph_parameters_structure const& sph_parameters) {
+    return h_ij / sph_parameters.h;
+}
+
+// Kernels, p_i and p_j must be closer than h
+float W_density(cgp::vec3 const& p_i, cgp::vec3 const& p_j, float h);
+cgp::vec3 W_gradient_pressure(cgp::vec3 const& p_i, cgp::vec3 const& p_j, float h);
+float W_laplacian_viscosity(cgp::vec3 const& p_i, cgp::vec3 const& p_j, float h);
+
+// Number of sub-step levels available to the multi-rate time stepping
+int const max_time_step_levels = 8;
+
+struct time_step_parameters_structure {
+    bool adaptive = true; // Choose dt from the CFL and force criteria instead of using the whole frame time
+
+    float cfl = 0.3f; // Fraction of h a particle or a pressure wave may travel during one step
+
+    float force_factor = 0.5f; // Fraction of sqrt(h / |a|) allowed by the force criterion
+
+    float dt_min = 1e-5f; // Lower bound of the time step so that a blow-up cannot freeze the frame
+
+    bool multi_rate = false; // Bin the particles into power-of-two sub-step levels so that only fast ones take small steps
+
+    int max_level = 4; // Finest sub-step level, its step is dt / 2^max_level (must be below max_time_step_levels)
+};
+
+struct time_step_statistics {
+    float dt = 0.0f; // Last base time step chosen by the solver
+
+    int steps = 0; // Number of sub-steps computed during the last frame
+
+    unsigned long level_histogram[max_time_step_levels] = {}; // Number of active particles in each sub-step level
+
+    float max_velocity = 0.0f; // Max-reduction of the particle speeds during the last integration
+
+    float max_acceleration = 0.0f; // Max-reduction of the particle accelerations during the last integration
+
+    float min_scale = 1.0f; // Min-reduction of the particle resolutions during the last integration
+};
+
+/**
+ * @brief Track which particles are settled
+ *
+ * Particles moving faster than sleep_velocity wake up their neighbourhood. A particle falls asleep, and is then skipped
+ * by the density, force and integration passes, once it stayed calm for sleep_steps consecutive steps, its density
+ * changed by less than sleep_density_change over these steps and all its neighbours within h are calm or asleep
+ */
+void update_activity(Grid2d &grid, sph_parameters_structure const& sph_parameters);
+
+// Recompute the density of every active particle from its neighbours
+void update_density(Grid2d &grid, sph_parameters_structure const& sph_parameters);
+
+/**
+ * @brief Advance the simulation by frame_dt using adaptive time steps
+ *
+ * The base step is chosen from the CFL ((v + c) dt < cfl h, with c the speed of sound) and force
+ * (dt < force_factor sqrt(h / |a|)) criteria, using the velocity, acceleration and smallest smoothing length reduced
+ * during the previous frame, and the frame is split in the fewest equal steps below it. With multi_rate, particles are
+ * binned into power-of-two sub-step levels: only the due particles get their force recomputed and their velocity
+ * updated at each sub-step, and only them and their neighbours get their density and pressure recomputed (the others
+ * keep the values of their last use). Every active particle is still moved and the grid rebuilt at each finest
+ * sub-step, so the cost of a sub-step only shrinks by the density and force passes of the particles that are not due
+ */
+void simulate_frame(float frame_dt, Grid2d &grid, sph_parameters_structure const& sph_parameters,
+                    time_step_parameters_structure const& time_step_parameters, time_step_statistics &statistics);
+
+// Difference between the compact (quantized) storage and the full float storage on the same state
+struct compact_storage_report {
+    float max_density_error = 0.0f;  // Largest |rho_compact - rho_full| / rho_full
+    float mean_density_error = 0.0f;
+    float max_force_error = 0.0f;    // Largest |f_compact - f_full| / max(|f_full|, weight of the particle)
+    float mean_force_error = 0.0f;
+
+    double full_milliseconds = 0.0;    // Time of a density + force pass with the full float storage
+    double compact_milliseconds = 0.0; // Same with the compact storage, encoding included
 };
 
-void simulate(float dt, Grid2d &grid, sph_parameters_structure const& sph_parameters);
\ No newline at end of file
+/**
+ * @brief Compare the density and force passes computed from the compact storage of the grid with the full float ones
+ *
+ * Both passes run on the current state of the particles, which is left unchanged. The velocities are quantized if the
+ * grid currently quantizes them
+ */
+compact_storage_report measure_compact_storage(Grid2d &grid, sph_parameters_structure const& sph_parameters);
@@ -0,0 +1,118 @@
+// Check that splitting and merging particles keeps the density of the fluid continuous
+//
+// A settled tank is refined everywhere, then coarsened back. The mean density of the interior particles must stay close
+// to its value before the adaptation right after it, and come back to it once the particles have relaxed. The new
+// particles do not sit on a regular lattice and a kernel only covers a few neighbours, hence the looser tolerances right
+// after the adaptation (about 10% for a split and 17% for a merge are observed over several seeds). No particle may be
+// pushed through a wall. Returns a non-zero exit code on failure
+
+#include "grid2D.hpp"
+#include "simulation/simulation.hpp"
+#include "simulation/adaptive_resolution.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+using namespace cgp;
+
+namespace {
+
+float const split_tolerance = 0.13f;   // Allowed relative change of the mean interior density right after the splits
+float const merge_tolerance = 0.20f;   // Same right after the merges
+float const relaxed_tolerance = 0.05f; // Same once the particles have relaxed
+int const relaxation_frames = 100;
+
+// Mean density of the particles at least margin away from the walls and from the top of the fluid
+float mean_interior_density(Grid2d &grid, float top, float margin) {
+    float sum = 0.0f;
+    int count = 0;
+    for (auto particle : grid.get_all_particles()) {
+        vec3 const& p = particle->p;
+        if (std::abs(p.x) < 1 - margin && p.y > -1 + margin && p.y < top - margin) {
+            sum += particle->rho;
+            count++;
+        }
+    }
+
+    return count > 0 ? sum / count : 0.0f;
+}
+
+// Every particle must stay inside the bottom, left and right walls
+bool check_inside(char const* name, Grid2d &grid) {
+    int outside = 0;
+    for (auto particle : grid.get_all_particles()) {
+        vec3 const& p = particle->p;
+        outside += p.x < -1 || p.x > 1 || p.y < -1;
+    }
+
+    std::cout << (outside == 0 ? "[PASS] " : "[FAIL] ") << name << ": " << outside << " particles outside of the walls"
+              << std::endl;
+    return outside == 0;
+}
+
+bool check(char const* name, float reference, float value, float tolerance) {
+    float const error = std::abs(value - reference) / reference;
+    bool const passed = error <= tolerance;
+
+    std::cout << (passed ? "[PASS] " : "[FAIL] ") << name << ": mean interior density " << reference << " -> " << value
+              << " (" << 100 * error << "%)" << std::endl;
+    return passed;
+}
+
+}
+
+int main() {
+    sph_parameters_structure sph_parameters;
+    sph_parameters.sleeping = false; // Sleeping particles are never split
+
+    Grid2d grid(sph_parameters);
+    grid_init_param param;
+    param.seed = 1;
+    grid.create_grid(param);
+
+    time_step_parameters_structure time_step_parameters;
+    time_step_statistics time_step_stats;
+    auto const relax = [&](int frames) {
+        for (int frame = 0; frame < frames; ++frame) {
+            simulate_frame(0.005f, grid, sph_parameters, time_step_parameters, time_step_stats);
+        }
+    };
+    relax(300);
+
+    float top = -1.0f;
+    for (auto particle : grid.get_all_particles()) {
+        top = std::max(top, particle->p.y);
+    }
+    float const margin = 2 * sph_parameters.h;
+    float const reference = mean_interior_density(grid, top, margin);
+
+    bool passed = true;
+
+    // Every particle is on the "surface": all of them are split once
+    resolution_parameters_structure split_parameters;
+    split_parameters.surface_threshold = 0.0f;
+    resolution_statistics resolution_stats;
+    update_resolution(grid, sph_parameters, split_parameters, resolution_stats);
+    update_density(grid, sph_parameters);
+    passed &= resolution_stats.splits > 0;
+    passed &= check("split", reference, mean_interior_density(grid, top, margin), split_tolerance);
+    passed &= check_inside("split", grid);
+    relax(relaxation_frames);
+    passed &= check("split, relaxed", reference, mean_interior_density(grid, top, margin), relaxed_tolerance);
+
+    // Every particle is calm and interior: the children are merged in pairs
+    resolution_parameters_structure merge_parameters;
+    merge_parameters.surface_threshold = 1e6f;
+    merge_parameters.vorticity_threshold = 1e6f;
+    merge_parameters.merge_velocity = 1e6f;
+    update_resolution(grid, sph_parameters, merge_parameters, resolution_stats);
+    update_density(grid, sph_parameters);
+    passed &= resolution_stats.merges > 0;
+    passed &= check("merge", reference, mean_interior_density(grid, top, margin), merge_tolerance);
+    passed &= check_inside("merge", grid);
+    relax(relaxation_frames);
+    passed &= check("merge, relaxed", reference, mean_interior_density(grid, top, margin), relaxed_tolerance);
+
+    return passed ? 0 : 1;
+}
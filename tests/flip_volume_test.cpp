@@ -0,0 +1,50 @@
+// Check that the FLIP solver keeps the volume of a settled tank
+//
+// The particles start on a lattice of spacing 1.2 h, so that the fluid covers N (1.2 h)^2 of the domain, whose width is
+// 2. After 10 s at rest, the height of the fluid (twice the height of its centre of mass above the bottom wall) must stay
+// within a few percent of the initial one. Without the density correction the particles keep half a cell away from the
+// walls and the fluid gains about 11%, about 2% are lost with it. Returns a non-zero exit code on failure
+
+#include "grid2D.hpp"
+#include "simulation/flip.hpp"
+
+#include <cmath>
+#include <iostream>
+
+namespace {
+
+float const height_tolerance = 0.05f; // Allowed relative change of the height of the fluid
+float const spacing = 1.2f;
+int const frames = 2000;
+
+}
+
+int main() {
+    sph_parameters_structure sph_parameters;
+    Grid2d grid(sph_parameters);
+    grid.create_grid(grid_init_param(spacing, cgp::vec2(0.2f, 0.2f), NONE, 1));
+
+    float const width = 2.0f;
+    float const expected = grid.get_number_of_particles() * spacing * sph_parameters.h * spacing * sph_parameters.h / width;
+
+    FlipSolver solver;
+    flip_parameters_structure flip_parameters;
+    time_step_statistics time_step_stats;
+    for (int frame = 0; frame < frames; ++frame) {
+        solver.simulate_frame(0.005f, grid, sph_parameters, flip_parameters, time_step_stats);
+    }
+
+    float mean_y = 0.0f;
+    for (auto particle : grid.get_all_particles()) {
+        mean_y += particle->p.y;
+    }
+    mean_y /= grid.get_number_of_particles();
+    float const height = 2 * (mean_y + 1);
+
+    float const error = std::abs(height - expected) / expected;
+    bool const passed = error <= height_tolerance;
+    std::cout << (passed ? "[PASS] " : "[FAIL] ") << "flip volume: height " << expected << " -> " << height << " ("
+              << 100 * error << "%)" << std::endl;
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+// Check the neighbour queries of the grid against a brute force search over every particle
+//
+// Random particles (a few of them outside of the domain) are queried for every combination of periodic axes, cell size
+// (h, h/2, h/3) and far cell skipping. The radius and box queries must find exactly the particles of the brute force
+// search, each once, and the k nearest query the same distances. Along periodic axes the brute force search tries every
+// image of the particles. Returns a non-zero exit code on failure
+
+#include "grid2D.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <vector>
+
+using namespace cgp;
+
+namespace {
+
+int const number_of_particles = 2000;
+int const number_of_queries = 200;
+int const k_values[] = {1, 8, 40};
+
+// Images of a coordinate along an axis: itself, and its translations by the period when the axis is periodic
+std::vector<float> images(float x, bool periodic) {
+    return periodic ? std::vector<float>{x - 2.0f, x, x + 2.0f} : std::vector<float>{x};
+}
+
+float brute_force_distance(Grid2d const& grid, vec3 const& p, vec3 const& center) {
+    float distance = std::numeric_limits<float>::max();
+    for (float x : images(p.x, grid.is_periodic_x())) {
+        for (float y : images(p.y, grid.is_periodic_y())) {
+            distance = std::min(distance, norm(vec3{x, y, 0} - center));
+        }
+    }
+    return distance;
+}
+
+bool brute_force_in_box(Grid2d const& grid, vec3 const& p, vec3 const& min, vec3 const& max) {
+    for (float x : images(p.x, grid.is_periodic_x())) {
+        for (float y : images(p.y, grid.is_periodic_y())) {
+            if (x >= min.x && x <= max.x && y >= min.y && y <= max.y) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Number of particles found a wrong number of times (0 or more than once when expected, at all when not)
+int compare(Grid2d const& grid, std::map<particle_element*, int> const& found, std::vector<bool> const& expected) {
+    std::vector<particle_element*> const& particles = grid.get_all_particles();
+
+    int errors = 0;
+    for (size_t k = 0; k < particles.size(); ++k) {
+        auto const it = found.find(particles[k]);
+        int const count = it == found.end() ? 0 : it->second;
+        errors += count != (expected[k] ? 1 : 0);
+    }
+    return errors;
+}
+
+// Number of failed queries of one configuration
+int check_configuration(bool periodic_x, bool periodic_y, int subdivision, bool skip_far_cells, unsigned int seed) {
+    sph_parameters_structure sph_parameters;
+    float const h = sph_parameters.h;
+
+    Grid2d grid(sph_parameters);
+    grid.set_periodic(periodic_x, periodic_y);
+    grid.set_stencil(subdivision, skip_far_cells);
+
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> domain(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> beyond(-1.1f, 1.1f);
+    for (int k = 0; k < number_of_particles; ++k) {
+        particle_element* particle = new particle_element();
+        particle->p = k % 100 == 0 ? vec3{beyond(generator), beyond(generator), 0} : vec3{domain(generator), domain(generator), 0};
+        grid.add_particle(particle);
+    }
+    grid.update_particles();
+
+    std::vector<particle_element*> const& particles = grid.get_all_particles();
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    int failures = 0;
+    for (int query = 0; query < number_of_queries; ++query) {
+        vec3 const center{beyond(generator), beyond(generator), 0};
+
+        // Radius query
+        float const radius = (0.5f + 2.0f * unit(generator)) * h;
+        std::map<particle_element*, int> found;
+        grid.for_each_particle_in_radius(center, radius, [&](particle_element* particle) {
+            found[particle]++;
+        });
+        std::vector<bool> expected(particles.size());
+        for (size_t k = 0; k < particles.size(); ++k) {
+            expected[k] = brute_force_distance(grid, particles[k]->p, center) < radius;
+        }
+        failures += compare(grid, found, expected) > 0;
+
+        // Box query
+        vec3 const size{0.6f * unit(generator), 0.6f * unit(generator), 0};
+        vec3 const min = center - 0.5f * size;
+        vec3 const max = center + 0.5f * size;
+        found.clear();
+        grid.for_each_particle_in_box(min, max, [&](particle_element* particle) {
+            found[particle]++;
+        });
+        for (size_t k = 0; k < particles.size(); ++k) {
+            expected[k] = brute_force_in_box(grid, particles[k]->p, min, max);
+        }
+        failures += compare(grid, found, expected) > 0;
+
+        // k nearest query: same distances as the k smallest of the brute force search
+        std::vector<float> distances(particles.size());
+        for (size_t k = 0; k < particles.size(); ++k) {
+            distances[k] = brute_force_distance(grid, particles[k]->p, center);
+        }
+        std::sort(distances.begin(), distances.end());
+        for (int k : k_values) {
+            std::vector<particle_element*> nearest(k);
+            bool passed = grid.get_k_nearest(center, k, nearest.data()) == k;
+            for (int n = 0; passed && n < k; ++n) {
+                passed = std::abs(brute_force_distance(grid, nearest[n]->p, center) - distances[n]) < 1e-5f;
+            }
+            failures += !passed;
+        }
+    }
+
+    return failures;
+}
+
+}
+
+int main() {
+    bool passed = true;
+
+    unsigned int seed = 1;
+    for (int periodic = 0; periodic < 4; ++periodic) {
+        bool const periodic_x = (periodic & 1) != 0;
+        bool const periodic_y = (periodic & 2) != 0;
+        for (int subdivision = 1; subdivision <= 3; ++subdivision) {
+            for (int skip = 0; skip <= 1; ++skip) {
+                int const failures = check_configuration(periodic_x, periodic_y, subdivision, skip == 1, seed++);
+                passed &= failures == 0;
+
+                std::cout << (failures == 0 ? "[PASS] " : "[FAIL] ") << "periodic x " << periodic_x << ", periodic y "
+                          << periodic_y << ", cells h/" << subdivision << (skip == 1 ? ", skip far cells" : "") << ": "
+                          << failures << " failed queries" << std::endl;
+            }
+        }
+    }
+
+    return passed ? 0 : 1;
+}
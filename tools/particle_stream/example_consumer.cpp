@@ -0,0 +1,68 @@
+// Example of an external process following the simulation through shared memory
+//
+//  Usage: particle_consumer [segment name] [duration in seconds]
+//
+// Prints, about ten times per second, statistics of the latest published frame computed in place in the shared memory.
+
+#include "particle_stream_reader.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+
+int main(int argc, char* argv[]) {
+    std::string const name = argc > 1 ? argv[1] : PARTICLE_STREAM_DEFAULT_NAME;
+    double const duration = argc > 2 ? std::atof(argv[2]) : 0.0; // 0: run until interrupted
+
+    ParticleStreamReader reader;
+    uint64_t last_frame = 0;
+    unsigned long torn_frames = 0;
+
+    auto const start = std::chrono::steady_clock::now();
+    while (duration <= 0 || std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < duration) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        // Wait for the solver, and follow it when it recreates the segment
+        if (!reader.is_open() || reader.is_closed_by_writer()) {
+            if (!reader.open(name)) {
+                std::cout << "Waiting for " << name << " ..." << std::endl;
+                continue;
+            }
+            last_frame = 0;
+        }
+
+        particle_frame_view frame;
+        if (!reader.acquire_latest(frame) || frame.frame == last_frame) {
+            continue;
+        }
+
+        double rho_sum = 0;
+        double speed_sum = 0;
+        float rho_max = 0;
+        for (uint32_t i = 0; i < frame.number_of_particles; ++i) {
+            rho_sum += frame.rho[i];
+            rho_max = std::max(rho_max, frame.rho[i]);
+            speed_sum += std::sqrt(frame.vx[i] * frame.vx[i] + frame.vy[i] * frame.vy[i]);
+        }
+
+        if (!reader.is_valid(frame)) {
+            torn_frames++; // Overwritten while reading, the next frame will do
+            continue;
+        }
+
+        uint32_t const N = std::max(1u, frame.number_of_particles);
+        std::cout << "frame " << frame.frame << " (skipped " << (last_frame == 0 ? 0 : frame.frame - last_frame - 1) << ")"
+                  << "  t=" << frame.time << "  step " << frame.step
+                  << "  particles " << frame.number_of_particles
+                  << "  mean rho " << rho_sum / N << "  max rho " << rho_max
+                  << "  mean speed " << speed_sum / N
+                  << "  torn " << torn_frames << std::endl;
+
+        last_frame = frame.frame;
+    }
+
+    return 0;
+}
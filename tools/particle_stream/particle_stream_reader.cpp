@@ -0,0 +1,139 @@
+#include "particle_stream_reader.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef SPH_HAS_SHARED_MEMORY
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+ParticleStreamReader::~ParticleStreamReader() {
+    close();
+}
+
+bool ParticleStreamReader::open(std::string const& name) {
+    close();
+
+#ifdef SPH_HAS_SHARED_MEMORY
+    int const fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat status;
+    void* memory = MAP_FAILED;
+    if (fstat(fd, &status) == 0 && status.st_size >= static_cast<off_t>(sizeof(particle_stream_header))) {
+        memory = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+
+    auto* candidate = static_cast<particle_stream_header*>(memory);
+    bool const valid = candidate->magic == particle_stream_magic;
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (!valid || candidate->version != particle_stream_version ||
+        candidate->segment_size > static_cast<uint64_t>(status.st_size)) {
+        munmap(memory, static_cast<size_t>(status.st_size));
+        return false;
+    }
+
+    header = candidate;
+    segment_size = static_cast<uint64_t>(status.st_size);
+    return true;
+#else
+    (void) name;
+    return false;
+#endif
+}
+
+void ParticleStreamReader::close() {
+#ifdef SPH_HAS_SHARED_MEMORY
+    if (header != nullptr) {
+        munmap(header, segment_size);
+    }
+#endif
+    header = nullptr;
+    segment_size = 0;
+}
+
+bool ParticleStreamReader::is_closed_by_writer() const {
+    return header != nullptr && header->closed.load(std::memory_order_acquire) != 0;
+}
+
+uint64_t ParticleStreamReader::latest_frame() const {
+    return header != nullptr ? header->latest_frame.load(std::memory_order_acquire) : 0;
+}
+
+bool ParticleStreamReader::acquire_latest(particle_frame_view& view) const {
+    uint64_t const frame = latest_frame();
+    if (frame == 0) {
+        return false;
+    }
+
+    particle_stream_slot* slot = particle_stream_get_slot(header, frame);
+    if (slot->sequence.load(std::memory_order_acquire) != 2 * frame) {
+        return false;
+    }
+
+    uint32_t const capacity = header->capacity;
+    view.frame = frame;
+    view.step = slot->step;
+    view.time = slot->time;
+    view.number_of_particles = std::min(slot->number_of_particles, capacity);
+    view.x = particle_stream_get_field(slot, capacity, FIELD_X);
+    view.y = particle_stream_get_field(slot, capacity, FIELD_Y);
+    view.vx = particle_stream_get_field(slot, capacity, FIELD_VX);
+    view.vy = particle_stream_get_field(slot, capacity, FIELD_VY);
+    view.rho = particle_stream_get_field(slot, capacity, FIELD_RHO);
+    view.slot = slot;
+
+    return is_valid(view);
+}
+
+bool ParticleStreamReader::is_valid(particle_frame_view const& view) const {
+    if (view.slot == nullptr) {
+        return false;
+    }
+
+    // Keep the reads of the frame before the second read of the sequence
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return view.slot->sequence.load(std::memory_order_relaxed) == 2 * view.frame;
+}
+
+bool ParticleStreamReader::copy_latest(particle_frame_view& view, float* x, float* y, float* vx, float* vy, float* rho,
+                                       uint32_t capacity, int max_attempts) const {
+    for (int attempt = 0; attempt < max_attempts; ++attempt) {
+        particle_frame_view shared;
+        if (!acquire_latest(shared)) {
+            continue;
+        }
+
+        uint32_t const N = std::min(shared.number_of_particles, capacity);
+        std::memcpy(x, shared.x, N * sizeof(float));
+        std::memcpy(y, shared.y, N * sizeof(float));
+        std::memcpy(vx, shared.vx, N * sizeof(float));
+        std::memcpy(vy, shared.vy, N * sizeof(float));
+        std::memcpy(rho, shared.rho, N * sizeof(float));
+
+        if (is_valid(shared)) {
+            view = shared;
+            view.number_of_particles = N;
+            view.x = x;
+            view.y = y;
+            view.vx = vx;
+            view.vy = vy;
+            view.rho = rho;
+            view.slot = nullptr; // The copy does not depend on the ring anymore
+            return true;
+        }
+    }
+
+    return false;
+}
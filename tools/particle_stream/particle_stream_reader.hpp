@@ -0,0 +1,89 @@
+#pragma once
+
+// Reader of the particles published by the solver in shared memory (see src/export/particle_stream.hpp)
+//
+// Typical use:
+//
+//     ParticleStreamReader reader;
+//     reader.open(PARTICLE_STREAM_DEFAULT_NAME);
+//     particle_frame_view frame;
+//     if (reader.acquire_latest(frame)) {
+//         ... read frame.x[i], frame.rho[i], ... in place ...
+//         if (!reader.is_valid(frame)) { discard the results, the frame was overwritten meanwhile }
+//     }
+
+#include "export/particle_stream.hpp"
+
+#include <string>
+
+// A frame of the ring, the arrays point directly into the shared memory
+struct particle_frame_view {
+    uint64_t frame = 0;
+    uint64_t step = 0;
+    double time = 0;
+    uint32_t number_of_particles = 0;
+
+    float const* x = nullptr;
+    float const* y = nullptr;
+    float const* vx = nullptr;
+    float const* vy = nullptr;
+    float const* rho = nullptr;
+
+    particle_stream_slot const* slot = nullptr;
+};
+
+class ParticleStreamReader {
+public:
+    ParticleStreamReader() = default;
+    ~ParticleStreamReader();
+
+    ParticleStreamReader(ParticleStreamReader const&) = delete;
+    ParticleStreamReader& operator=(ParticleStreamReader const&) = delete;
+
+    /**
+     * @brief Attach to the segment, read only
+     *
+     * @return false if the segment does not exist (yet) or is not a particle stream
+     */
+    bool open(std::string const& name);
+
+    void close();
+
+    bool is_open() const { return header != nullptr; }
+
+    /**
+     * @brief Whether the writer abandoned the segment (solver stopped or segment grown), open it again to follow it
+     */
+    bool is_closed_by_writer() const;
+
+    /**
+     * @brief Number of the last completed frame, 0 if none
+     */
+    uint64_t latest_frame() const;
+
+    /**
+     * @brief Point the view to the last completed frame, without copying it
+     *
+     * @return false if no frame is available or the writer is currently overwriting it
+     */
+    bool acquire_latest(particle_frame_view& view) const;
+
+    /**
+     * @brief Whether the frame is still intact, to be called once done reading it
+     *
+     * Values read from a view are only meaningful if this returns true afterwards
+     */
+    bool is_valid(particle_frame_view const& view) const;
+
+    /**
+     * @brief Copy the last completed frame, retrying until a consistent copy is obtained
+     *
+     * @return false if no frame is available
+     */
+    bool copy_latest(particle_frame_view& view, float* x, float* y, float* vx, float* vy, float* rho,
+                     uint32_t capacity, int max_attempts = 16) const;
+
+private:
+    particle_stream_header* header = nullptr;
+    uint64_t segment_size = 0;
+};